@@ -0,0 +1,35 @@
+#!/bin/sh
+# Times the ls built-in against directory size, and checks its output matches LANG=C ls -1.
+# Usage: bench/ls-bench.sh [path/to/wsh] [sizes...]
+# Prints one line per size: entries=<n> wsh_ms=<ms> ls_ms=<ms> match=<yes|no>
+
+WSH=${1:-./wsh}
+[ $# -gt 0 ] && shift
+SIZES=${*:-"1000 10000 100000 500000"}
+
+WSH=$(cd "$(dirname "$WSH")" && pwd)/$(basename "$WSH")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ms() {
+    date +%s%N | cut -c1-13
+}
+
+echo "ls" > "$WORK/ls.wsh"
+
+for n in $SIZES; do
+    dir="$WORK/dir$n"
+    mkdir "$dir"
+    # Random-looking names so directory order is far from sorted
+    (cd "$dir" && seq 1 "$n" | awk '{ printf "f%08x_%d\n", ($1 * 2654435761) % 4294967296, $1 }' | xargs touch)
+
+    start=$(now_ms)
+    (cd "$dir" && "$WSH" "$WORK/ls.wsh" > "$WORK/wsh.out")
+    mid=$(now_ms)
+    (cd "$dir" && LANG=C LC_ALL=C ls -1 > "$WORK/ls.out")
+    end=$(now_ms)
+
+    if cmp -s "$WORK/wsh.out" "$WORK/ls.out"; then match=yes; else match=no; fi
+    echo "entries=$n wsh_ms=$((mid - start)) ls_ms=$((end - mid)) match=$match"
+    rm -rf "$dir"
+done
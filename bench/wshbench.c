@@ -0,0 +1,302 @@
+/*
+ * wshbench: Runs synthetic batch-mode workloads through a wsh-bench binary and reports,
+ * one JSON object per line: commands/sec, p50/p99 per-command latency and peak RSS.
+ *
+ * Usage: wshbench [-n max_commands] path/to/wsh-bench
+ * The trivial-command workload runs at 10k, 100k, ... up to max_commands (default 1M).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Scratch directory every workload runs in
+char work_dir[] = "/tmp/wshbench.XXXXXX";
+const char *wsh_path;
+
+/*
+ * Opens a fresh script file in the scratch directory
+ */
+FILE *open_script(const char *name)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", work_dir, name);
+    FILE *script = fopen(path, "w");
+    if (script == NULL)
+    {
+        perror("fopen");
+        exit(1);
+    }
+    return script;
+}
+
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Runs wsh-bench on a script in the scratch directory and prints the workload's JSON record
+ */
+void run_workload(const char *workload, const char *script_name)
+{
+    char script_path[4096], log_path[4096];
+    snprintf(script_path, sizeof(script_path), "%s/%s", work_dir, script_name);
+    snprintf(log_path, sizeof(log_path), "%s/latency.bin", work_dir);
+    unlink(log_path);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        // Command output is not part of the measurement
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (chdir(work_dir) < 0) _exit(127);
+        setenv("WSH_BENCH_LOG", log_path, 1);
+        execl(wsh_path, wsh_path, script_path, (char *)NULL);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+    {
+        perror("wait4");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Per-command latencies, raw uint64_t nanoseconds
+    uint64_t *latencies = NULL;
+    size_t count = 0;
+    int log_fd = open(log_path, O_RDONLY);
+    struct stat st;
+    if (log_fd >= 0 && fstat(log_fd, &st) == 0 && st.st_size > 0)
+    {
+        latencies = malloc(st.st_size);
+        if (latencies != NULL && read(log_fd, latencies, st.st_size) == st.st_size) count = st.st_size / sizeof(uint64_t);
+    }
+    if (log_fd >= 0) close(log_fd);
+
+    double p50 = 0, p99 = 0;
+    if (count > 0)
+    {
+        qsort(latencies, count, sizeof(uint64_t), compare_u64);
+        p50 = latencies[count / 2] / 1000.0;
+        p99 = latencies[(count * 99) / 100] / 1000.0;
+    }
+    free(latencies);
+
+    printf("{\"workload\":\"%s\",\"commands\":%zu,\"seconds\":%.6f,\"commands_per_sec\":%.1f,"
+           "\"p50_us\":%.2f,\"p99_us\":%.2f,\"max_rss_kb\":%ld,\"exit_status\":%d}\n",
+           workload, count, seconds, (seconds > 0) ? count / seconds : 0.0,
+           p50, p99, usage.ru_maxrss, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    fflush(stdout);
+}
+
+/*
+ * Built-in commands only, so the numbers are the shell's own per-line cost
+ */
+void bench_trivial(long commands)
+{
+    FILE *script = open_script("trivial.wsh");
+    for (long i = 0; i < commands; i++) fputs("cd .\n", script);
+    fclose(script);
+
+    char name[64];
+    snprintf(name, sizeof(name), "trivial-%ld", commands);
+    run_workload(name, "trivial.wsh");
+}
+
+/*
+ * External commands, dominated by process creation
+ */
+void bench_external(long commands)
+{
+    FILE *script = open_script("external.wsh");
+    for (long i = 0; i < commands; i++) fputs("/bin/true\n", script);
+    fclose(script);
+
+    char name[64];
+    snprintf(name, sizeof(name), "external-%ld", commands);
+    run_workload(name, "external.wsh");
+}
+
+/*
+ * Defines many locals, then runs lines that expand a batch of them each
+ */
+void bench_variables(long variables, long lines)
+{
+    FILE *script = open_script("variables.wsh");
+    for (long i = 0; i < variables; i++) fprintf(script, "local v%ld=value%ld\n", i, i);
+    for (long i = 0; i < lines; i++)
+    {
+        fputs("cd .", script);
+        for (int j = 0; j < 16; j++) fprintf(script, " $v%ld", (i * 16 + j) % variables);
+        fputc('\n', script);
+    }
+    fclose(script);
+
+    char name[64];
+    snprintf(name, sizeof(name), "variables-%ld", variables);
+    run_workload(name, "variables.wsh");
+}
+
+/*
+ * Built-in and external commands with input, output and error redirections
+ */
+void bench_redirections(long lines)
+{
+    FILE *script = open_script("redirections.wsh");
+    for (long i = 0; i < lines; i++)
+    {
+        if (i % 10 == 0) fputs("/bin/true <in.txt >out.txt 2>>err.txt\n", script);
+        else fputs("hash >out.txt 2>>err.txt\n", script);
+    }
+    fclose(script);
+    fclose(open_script("in.txt"));
+
+    char name[64];
+    snprintf(name, sizeof(name), "redirections-%ld", lines);
+    run_workload(name, "redirections.wsh");
+}
+
+/*
+ * The ls built-in on one large directory
+ */
+void bench_ls(long entries, long runs)
+{
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/lsdir", work_dir);
+    mkdir(dir, 0755);
+    for (long i = 0; i < entries; i++)
+    {
+        char path[4200];
+        snprintf(path, sizeof(path), "%s/f%08lx_%ld", dir, (unsigned long)((i * 2654435761u) & 0xffffffffu), i);
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd >= 0) close(fd);
+    }
+
+    FILE *script = open_script("ls.wsh");
+    fputs("cd lsdir\n", script);
+    for (long i = 0; i < runs; i++) fputs("ls >/dev/null\n", script);
+    fclose(script);
+
+    char name[64];
+    snprintf(name, sizeof(name), "ls-%ld", entries);
+    run_workload(name, "ls.wsh");
+}
+
+/*
+ * A large history filled with distinct external commands, then listed
+ */
+void bench_history(long size, long commands)
+{
+    FILE *script = open_script("history.wsh");
+    fprintf(script, "history set %ld\n", size);
+    for (long i = 0; i < commands; i++) fprintf(script, "/bin/true %ld\n", i);
+    fputs("history >/dev/null\n", script);
+    fclose(script);
+
+    char name[64];
+    snprintf(name, sizeof(name), "history-%ld", size);
+    run_workload(name, "history.wsh");
+}
+
+/*
+ * Parse throughput: long lines full of quoting, escapes and embedded expansions run through
+ * the true built-in, so the lexer is nearly all of the per-line cost
+ */
+void bench_parse(long lines)
+{
+    FILE *script = open_script("parse.wsh");
+    fputs("local A=alpha\nlocal B=bravo\nlocal C=charlie\n", script);
+    for (long i = 0; i < lines; i++)
+    {
+        fprintf(script, "true \"quoted $A text %ld\" ${B}/suffix/%ld 'single $C quoted' pre$C.post esc\\ aped", i, i);
+        fputs(" \"$A$B$C\" x$A y$B z$C plain words that need no expansion at all\n", script);
+    }
+    fclose(script);
+
+    char name[64];
+    snprintf(name, sizeof(name), "parse-%ld", lines);
+    run_workload(name, "parse.wsh");
+}
+
+/*
+ * Removes the scratch directory
+ */
+void cleanup()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execl("/bin/rm", "rm", "-rf", work_dir, (char *)NULL);
+        _exit(127);
+    }
+    if (pid > 0) waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    long max_commands = 1000000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        if (opt == 'n') max_commands = atol(optarg);
+        else
+        {
+            fprintf(stderr, "usage: %s [-n max_commands] path/to/wsh-bench\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-n max_commands] path/to/wsh-bench\n", argv[0]);
+        return 1;
+    }
+
+    wsh_path = realpath(argv[optind], NULL);
+    if (wsh_path == NULL)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (mkdtemp(work_dir) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    for (long n = 10000; n <= max_commands; n *= 10) bench_trivial(n);
+    bench_external(10000);
+    bench_variables(10000, 100000);
+    bench_redirections(20000);
+    bench_ls(200000, 20);
+    bench_history(100000, 10000);
+    bench_parse(200000);
+
+    cleanup();
+    return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * wsh-client: Runs a script on a wsh server started with wsh --server <socket>.
+ * The script, this process's stdin, stdout and stderr and its cwd are passed to the server
+ * with SCM_RIGHTS, so the script reads and writes here and runs in this directory.
+ * Exits with the script's exit status.
+ *
+ * Usage: wsh-client <socket> [script]
+ * Without a script, the script is read from stdin.
+ */
+#include "wsh.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "usage: %s <socket> [script]\n", argv[0]);
+        return 2;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "wsh-client: socket path too long\n");
+        return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    int script_fd = STDIN_FILENO;
+    if (argc == 3)
+    {
+        script_fd = open(argv[2], O_RDONLY | O_CLOEXEC);
+        if (script_fd < 0)
+        {
+            perror(argv[2]);
+            return 2;
+        }
+    }
+    int cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd < 0)
+    {
+        perror("open");
+        return 2;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror(argv[1]);
+        return 2;
+    }
+
+    // Script, stdin, stdout, stderr and cwd, the order the server expects
+    int fds[WSH_SERVER_NFDS] = { script_fd, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd_fd };
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+    {
+        perror("sendmsg");
+        return 2;
+    }
+
+    // The server holds its own copies now
+    if (script_fd != STDIN_FILENO) close(script_fd);
+    close(cwd_fd);
+
+    // The script's status comes back when it finishes, a closed socket means it died without one
+    int32_t status;
+    size_t got = 0;
+    while (got < sizeof(status))
+    {
+        ssize_t n = read(sock, (char *)&status + got, sizeof(status) - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            fprintf(stderr, "wsh-client: server closed the connection without a status\n");
+            return 255;
+        }
+        got += n;
+    }
+    close(sock);
+
+    return status & 0xff;
+}
@@ -1,25 +1,430 @@
 #include "wsh.h"
 
-// Allocate memory for polling input from stdin to line, and tokenizing arguments
-char line[MAXLINE]; 
-char *args[MAXARGS]; 
-char **history_list;
+// Input line buffer, grown by getline so lines have no length limit
+char *line = NULL;
+size_t line_capacity = 0;
+
+// Script being run in batch mode, closed on exit
+ScriptReader *script_input = NULL;
+
+// How many source commands are running inside one another
+int source_depth = 0;
+
+// Whole-script program being run, compiled now or mapped from the script cache, released on exit
+Program *script_program = NULL;
+char *script_cache_map = NULL;
+size_t script_cache_size = 0;
+
+// Connection a server-mode script reports its exit status on, and the process that owns it
+int server_conn = -1;
+pid_t server_pid = 0;
+
+// Zygote helper that external commands are spawned through when WSH_ZYGOTE is set
+int zygote_fd = -1;
+pid_t zygote_pid = 0;
+pid_t zygote_owner = 0;
+char **zygote_env = NULL;  // Sorted copy of the environment the zygote started with
+int zygote_env_count = 0;
+
+// Bump allocator for everything that lives for one command line: its copy for history,
+// tokens, argv and substitution results. Reset in O(1) after the line runs.
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct Arena
+{
+    ArenaBlock *first;
+    ArenaBlock *current;
+} Arena;
+
+// A position in an arena to release back to
+typedef struct ArenaMark
+{
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+Arena line_arena = { NULL, NULL };
+
+// Block being compiled, and the if/while/for constructs still open in it
+Program *compiling_program = NULL;
+OpenBlock *open_blocks = NULL;
+uint32_t num_open_blocks = 0;
+uint32_t open_blocks_capacity = 0;
+
+// While compiling, the lexer records words as segments in this program instead of expanding them
+Program *compile_target = NULL;
+
+// Set while a whole script is compiled for the cache, where syntax errors are left to the uncached run
+int syntax_errors_quiet = 0;
+
+// History ring buffer, the newest entry is just before history_head.
+// Each slot keeps its string buffer, which is reused by later entries that fit in it.
+typedef struct HistoryEntry
+{
+    char *line;
+    size_t capacity;
+} HistoryEntry;
+
+HistoryEntry *history_list;
 int history_list_size = 5; // Originally 5
+int history_head = 0;
+int history_count = 0;
+
+// History file interactive sessions share, and the search index over it
+int history_fd = -1;
+HistoryIndex history_index;
 
 // Local var struct for shell variables
 typedef struct LocalVar 
 {
-    char *name;
+    char *name;         // NULL once the variable is removed
     char *value;
+    unsigned int hash;
 } LocalVar;
 
+// Variables are stored in insertion order (for vars), removed ones leave a hole until compaction
 LocalVar *local_variables;
-int num_local_variables = 0;
+int num_local_variables = 0;    // Used slots, including holes
+int local_variables_capacity = 0;
+int num_removed_variables = 0;
+
+// Open-addressing index over the variable names, each slot holds a position in local_variables
+#define VAR_EMPTY -1
+#define VAR_TOMBSTONE -2
+int *var_index = NULL;
+int var_index_size = 0;         // Always a power of two
+int var_index_used = 0;         // Live entries plus tombstones
 
 // return variable, error is -1
 int return_var = 0;
 
+// Shell options, changed with the set built-in
+int opt_pipefail = 0;
+
+// Append a resource record for every command here when set -o timelog is on, -1 when off
+int timelog_fd = -1;
+
+// Resource usage of every foreground process waited for, what time and timelog report from
+struct rusage child_usage;
+
+// Nesting of execute_commands, only the outermost command line is logged
+int command_depth = 0;
+
+// Set when reading commands from a user, enables job notifications and job control
+int interactive = 0;
+int job_control = 0;
+
+// Job table, background and stopped pipelines
+typedef enum JobState
+{
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+} JobState;
+
+typedef struct Job
+{
+    int id;
+    pid_t pgid;         // Process group of a background job, 0 when it shares the shell's group
+    pid_t *pids;        // Every process in the job, 0 once reaped
+    int npids;
+    int status;         // Status of the last process
+    int failed_status;  // Last non-zero status, for pipefail
+    JobState state;
+    char *command;
+    struct rusage usage; // Summed over the job's reaped processes, max for ru_maxrss
+} Job;
+
+Job *jobs = NULL;
+int num_jobs = 0;
+
+// SIGCHLD self-pipe, the handler only records that children changed state
+int sigchld_pipe[2] = { -1, -1 };
+volatile sig_atomic_t sigchld_pending = 0;
+
+// Command location cache entry, maps a command name to its resolved path in $PATH
+typedef struct CmdHashEntry
+{
+    char *name;
+    char *path;
+    int hits;
+    struct CmdHashEntry *next;
+} CmdHashEntry;
+
+#define CMD_HASH_BUCKETS 64
+CmdHashEntry *cmd_hash[CMD_HASH_BUCKETS];
+
+/*
+ * FNV-1a string hash, used for the command cache
+ */
+unsigned int hash_string(const char *s)
+{
+    unsigned int h = 2166136261u;
+    while (*s != '\0')
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Drops every remembered command location, done when PATH changes or on hash -r
+ */
+void hash_clear()
+{
+    for (int i = 0; i < CMD_HASH_BUCKETS; i++)
+    {
+        CmdHashEntry *entry = cmd_hash[i];
+        while (entry != NULL)
+        {
+            CmdHashEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        cmd_hash[i] = NULL;
+    }
+}
+
+/*
+ * Searches each directory in $PATH for an executable called cmd, stopping at the first hit.
+ * Returns a malloc'd full path, or NULL if the command is not found.
+ */
+char *find_in_path(const char *cmd)
+{
+    char *path = getenv("PATH");
+    if (path == NULL) return NULL;
+
+    size_t cmd_len = strlen(cmd);
+    const char *dir = path;
+    while (1)
+    {
+        // Each directory ends at the next ':' or the end of PATH
+        const char *end = strchr(dir, ':');
+        size_t dir_len = (end != NULL) ? (size_t)(end - dir) : strlen(dir);
+
+        if (dir_len > 0)
+        {
+            char *full_path = malloc(dir_len + cmd_len + 2);
+            if (full_path == NULL)
+            {
+                perror("malloc");
+                return NULL;
+            }
+            memcpy(full_path, dir, dir_len);
+            full_path[dir_len] = '/';
+            memcpy(full_path + dir_len + 1, cmd, cmd_len + 1);
+
+            // First executable match wins
+            if (access(full_path, X_OK) == 0) return full_path;
+            free(full_path);
+        }
+
+        if (end == NULL) break;
+        dir = end + 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Resolves cmd to a full path, consulting the command cache before searching $PATH.
+ * Successful searches are remembered until PATH changes or hash -r is run.
+ */
+const char *lookup_command(const char *cmd)
+{
+    unsigned int bucket = hash_string(cmd) % CMD_HASH_BUCKETS;
+
+    // Cache hit
+    for (CmdHashEntry *entry = cmd_hash[bucket]; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->name, cmd) == 0)
+        {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    // Cache miss, search PATH and remember the result
+    char *full_path = find_in_path(cmd);
+    if (full_path == NULL) return NULL;
+
+    CmdHashEntry *entry = malloc(sizeof(CmdHashEntry));
+    if (entry == NULL)
+    {
+        perror("malloc");
+        free(full_path);
+        return NULL;
+    }
+    entry->name = strdup(cmd);
+    entry->path = full_path;
+    entry->hits = 1;
+    entry->next = cmd_hash[bucket];
+    cmd_hash[bucket] = entry;
+
+    return entry->path;
+}
+
+/*
+ * Allocates size bytes from the arena, adding a block when the current ones are full.
+ * Blocks are kept across resets, so a line only mallocs when it is bigger than any before it.
+ */
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+
+    // Move through blocks kept from earlier lines before adding a new one
+    while (arena->current != NULL && arena->current->used + size > arena->current->size && arena->current->next != NULL)
+    {
+        arena->current = arena->current->next;
+        arena->current->used = 0;
+    }
+
+    if (arena->current == NULL || arena->current->used + size > arena->current->size)
+    {
+        size_t block_size = ARENA_BLOCK_SIZE;
+        while (block_size < size) block_size *= 2;
+
+        ArenaBlock *block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL)
+        {
+            perror("malloc");
+            exit(-1);
+        }
+        block->next = NULL;
+        block->size = block_size;
+        block->used = 0;
+
+        if (arena->current == NULL) arena->first = block;
+        else arena->current->next = block;
+        arena->current = block;
+    }
+
+    void *ptr = arena->current->data + arena->current->used;
+    arena->current->used += size;
+    return ptr;
+}
+
+/*
+ * Copies len bytes of str into the arena as a NUL terminated string
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/*
+ * Releases everything allocated from the arena at once
+ */
+void arena_reset(Arena *arena)
+{
+    arena->current = arena->first;
+    if (arena->first != NULL) arena->first->used = 0;
+}
+
+/*
+ * Records the arena's current position, so what is allocated after it can be released on its own
+ */
+ArenaMark arena_mark(Arena *arena)
+{
+    ArenaMark mark;
+    mark.block = arena->current;
+    mark.used = (arena->current != NULL) ? arena->current->used : 0;
+    return mark;
+}
+
+/*
+ * Releases everything allocated since mark, keeping the blocks for reuse
+ */
+void arena_release(Arena *arena, ArenaMark mark)
+{
+    if (mark.block == NULL)
+    {
+        arena_reset(arena);
+        return;
+    }
+    arena->current = mark.block;
+    mark.block->used = mark.used;
+}
+
+/*
+ * Returns the arena's blocks to the system
+ */
+void arena_free(Arena *arena)
+{
+    ArenaBlock *block = arena->first;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = arena->current = NULL;
+}
+
+#ifdef WSH_BENCH
+// Per-command latency recording for the wsh-bench build, written to $WSH_BENCH_LOG at exit
+// as raw uint64_t nanosecond values, one per executed command line
+uint64_t *bench_latencies = NULL;
+size_t bench_count = 0;
+size_t bench_capacity = 0;
+struct timespec bench_start;
+
+void bench_begin()
+{
+    clock_gettime(CLOCK_MONOTONIC, &bench_start);
+}
+
+void bench_end()
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (bench_count == bench_capacity)
+    {
+        size_t capacity = (bench_capacity > 0) ? bench_capacity * 2 : 4096;
+        uint64_t *grown = realloc(bench_latencies, capacity * sizeof(uint64_t));
+        if (grown == NULL) return;
+        bench_latencies = grown;
+        bench_capacity = capacity;
+    }
+    bench_latencies[bench_count++] = (uint64_t)(end.tv_sec - bench_start.tv_sec) * 1000000000u + (end.tv_nsec - bench_start.tv_nsec);
+}
+
+void bench_flush()
+{
+    const char *path = getenv("WSH_BENCH_LOG");
+    if (path != NULL && bench_count > 0)
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0)
+        {
+            write_all(fd, (const char *)bench_latencies, bench_count * sizeof(uint64_t));
+            close(fd);
+        }
+    }
+    free(bench_latencies);
+    bench_latencies = NULL;
+    bench_count = bench_capacity = 0;
+}
+#endif
+
 void free_memory() {
+#ifdef WSH_BENCH
+    bench_flush();
+#endif
+
     // Check if local_variables is allocated
     if (local_variables != NULL) 
     {
@@ -41,46 +446,194 @@ void free_memory() {
         free(local_variables);
         local_variables = NULL; // Avoid dangling pointer
     }
+    free(var_index);
+    var_index = NULL;
     
     // Free history list
-    for (int i = 0; i < history_list_size; i++) if (history_list[i] != NULL) free(history_list[i]); // Free each history item
-    if (history_list != NULL) free(history_list); // Free the history list array
+    if (history_list != NULL)
+    {
+        for (int i = 0; i < history_list_size; i++) free(history_list[i].line); // Free each history item
+        free(history_list); // Free the history list array
+    }
     history_list = NULL; // Avoid dangling pointer
+    history_close();
     
-    // Free args
-    if (args != NULL)
+    // Free command location cache
+    hash_clear();
+
+    // Free job table, the jobs themselves keep running
+    for (int i = 0; i < num_jobs; i++)
     {
-        for (int i = 0; i < MAXARGS; i++) 
-        {
-            if (args[i] != NULL) 
-            {
-                args[i] = NULL; // Avoid dangling pointer
-            }
-        }
+        free(jobs[i].pids);
+        free(jobs[i].command);
     }
+    free(jobs);
+    jobs = NULL;
+    num_jobs = 0;
+
+    // Let the zygote exit
+    zygote_stop();
+
+    // Drop a block left open and the compiler's stack
+    compile_abort();
+    free(open_blocks);
+    open_blocks = NULL;
+    open_blocks_capacity = 0;
+
+    // Free the input line and the line arena
+    free(line);
+    line = NULL;
+    arena_free(&line_arena);
+    if (script_input != NULL) script_close(script_input);
+    script_input = NULL;
+    script_program_free();
     
 }
 
 /*
- * This function checks for and substitutes variable values whenever a command is passed $
+ * Rebuilds the name index at new_size slots from the live variables, dropping tombstones
+ */
+int rebuild_var_index(int new_size)
+{
+    int *index = malloc(new_size * sizeof(int));
+    if (index == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 0; i < new_size; i++) index[i] = VAR_EMPTY;
+
+    var_index_used = 0;
+    for (int i = 0; i < num_local_variables; i++)
+    {
+        if (local_variables[i].name == NULL) continue;
+        unsigned int slot = local_variables[i].hash & (new_size - 1);
+        while (index[slot] != VAR_EMPTY) slot = (slot + 1) & (new_size - 1);
+        index[slot] = i;
+        var_index_used++;
+    }
+
+    free(var_index);
+    var_index = index;
+    var_index_size = new_size;
+    return 0;
+}
+
+/*
+ * Finds the index slot holding name, or -1 if the variable does not exist
+ */
+int find_var_slot(const char *name, unsigned int hash)
+{
+    if (var_index_size == 0) return -1;
+
+    unsigned int slot = hash & (var_index_size - 1);
+    while (var_index[slot] != VAR_EMPTY)
+    {
+        int pos = var_index[slot];
+        if (pos != VAR_TOMBSTONE && local_variables[pos].hash == hash && strcmp(local_variables[pos].name, name) == 0) return slot;
+        slot = (slot + 1) & (var_index_size - 1);
+    }
+    return -1;
+}
+
+/*
+ * Looks up a shell variable, returns its value or NULL if it is not set
  */
-char* substitute_var(char *arg)
+char *get_local(const char *name)
 {
-    // No variable substitution
-    if (arg[0] != '$') return arg;
+    int slot = find_var_slot(name, hash_string(name));
+    if (slot < 0) return NULL;
+    return local_variables[var_index[slot]].value;
+}
 
-    char* var_name = arg + 1;
+/*
+ * Creates or updates a shell variable. Updates happen in place so vars keeps insertion order.
+ * Returns 0, or -1 if memory ran out.
+ */
+int set_local(const char *name, const char *value)
+{
+    unsigned int hash = hash_string(name);
+    int slot = find_var_slot(name, hash);
 
-    // Check if an environment variable
-    char* env_value = getenv(var_name);
-    if (env_value != NULL) return env_value;
+    // Update existing value
+    if (slot >= 0)
+    {
+        LocalVar *var = &local_variables[var_index[slot]];
+        char *new_value = strdup(value);
+        if (new_value == NULL) return -1;
+        free(var->value);
+        var->value = new_value;
+        return 0;
+    }
 
-    // Check if local variable
-    for (int i = 0; i < num_local_variables; i++)
-    if (strcmp(local_variables[i].name, var_name) == 0) return local_variables[i].value;
+    // Storage grows geometrically
+    if (num_local_variables == local_variables_capacity)
+    {
+        int new_capacity = (local_variables_capacity > 0) ? local_variables_capacity * 2 : 16;
+        LocalVar *grown = realloc(local_variables, new_capacity * sizeof(LocalVar));
+        if (grown == NULL)
+        {
+            perror("realloc");
+            return -1;
+        }
+        local_variables = grown;
+        local_variables_capacity = new_capacity;
+    }
 
-    // If it doesn't exist, return blank
-    return "";
+    // Keep the index at most half full, counting tombstones
+    if ((var_index_used + 1) * 2 > var_index_size)
+    {
+        int new_size = (var_index_size > 0) ? var_index_size : 32;
+        while ((num_local_variables - num_removed_variables + 1) * 2 > new_size / 2) new_size *= 2;
+        if (rebuild_var_index(new_size) < 0) return -1;
+    }
+
+    LocalVar *var = &local_variables[num_local_variables];
+    var->name = strdup(name);
+    var->value = strdup(value);
+    var->hash = hash;
+    if (var->name == NULL || var->value == NULL)
+    {
+        free(var->name);
+        free(var->value);
+        return -1;
+    }
+
+    slot = hash & (var_index_size - 1);
+    while (var_index[slot] != VAR_EMPTY && var_index[slot] != VAR_TOMBSTONE) slot = (slot + 1) & (var_index_size - 1);
+    if (var_index[slot] == VAR_EMPTY) var_index_used++;
+    var_index[slot] = num_local_variables++;
+    return 0;
+}
+
+/*
+ * Removes a shell variable. The storage slot is left as a hole, and holes are compacted
+ * away (in order) once they outnumber the live variables.
+ */
+void unset_local(const char *name)
+{
+    int slot = find_var_slot(name, hash_string(name));
+    if (slot < 0) return;
+
+    LocalVar *var = &local_variables[var_index[slot]];
+    free(var->name);
+    free(var->value);
+    var->name = NULL;
+    var->value = NULL;
+    var_index[slot] = VAR_TOMBSTONE;
+    num_removed_variables++;
+
+    if (num_removed_variables > 16 && num_removed_variables * 2 > num_local_variables)
+    {
+        int live = 0;
+        for (int i = 0; i < num_local_variables; i++)
+        {
+            if (local_variables[i].name != NULL) local_variables[live++] = local_variables[i];
+        }
+        num_local_variables = live;
+        num_removed_variables = 0;
+        rebuild_var_index(var_index_size);
+    }
 }
 
 /*
@@ -97,6 +650,7 @@ void wsh_exit(char **args)
     } 
     else 
     {
+        server_report();
         free_memory();
         exit(return_var);
     }
@@ -133,6 +687,7 @@ void wsh_export(char **args)
      {
         perror("export");
         return_var = -1;
+        return;
      }
 
     char *var_name = strtok(args[1], "=");
@@ -143,6 +698,9 @@ void wsh_export(char **args)
 
     setenv(var_name, var_assignment, 1);
 
+    // Remembered command locations are stale once PATH changes
+    if (strcmp(var_name, "PATH") == 0) hash_clear();
+
     return_var = 0;
 }
 
@@ -151,65 +709,35 @@ void wsh_export(char **args)
  */
 void wsh_local(char **args)
 {
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "local: usage: local VAR=<value>\n");
+        return_var = -1;
+        return;
+    }
+
     // Delimit arg[1] by = to get the variable and the assignment
     char *var_name = strtok(args[1], "=");
     char *var_assignment = strtok(NULL, "=");
+    if (var_name == NULL)
+    {
+        fprintf(stderr, "local: invalid variable name\n");
+        return_var = -1;
+        return;
+    }
 
     // NULL assignment clears var
     if (var_assignment == NULL) var_assignment = "";
 
-    // Check if the variable already exists and update or remove it
-    for (int i = 0; i < num_local_variables; i++) {
-        if (strcmp(local_variables[i].name, var_name) == 0) 
-        {
-            // If value is empty, clear the variable
-            if (strcmp(var_assignment, "") == 0) 
-            {
-                free(local_variables[i].name);
-                free(local_variables[i].value);
-
-                // Shift the remaining variables up by one
-                for (int j = i; j < num_local_variables - 1; j++) 
-                {
-                    local_variables[j] = local_variables[j + 1];
-                }
-
-                // Decrease the count of local variables
-                num_local_variables--;
-
-                // Resize the array to free up unused memory
-                local_variables = realloc(local_variables, num_local_variables * sizeof(LocalVar));
-                if (local_variables == NULL && num_local_variables > 0) 
-                {
-                    perror("realloc");  // Memory allocation failed
-                    return_var = -1;
-                }
-
-                return;  // Variable removed, so exit
-            } 
-            else 
-            {
-                // Update existing value
-                free(local_variables[i].value);
-                local_variables[i].value = strdup(var_assignment);
-                return_var = 0;
-                return;
-            }
-        }
-    }
-
-    // Add new variable if not found
-    local_variables = realloc(local_variables, (num_local_variables + 1) * sizeof(LocalVar));
-    if (local_variables == NULL)
+    // NULL assignment clears an existing variable and creates a missing one empty, otherwise create or update it in place
+    if (strcmp(var_assignment, "") == 0 && get_local(var_name) != NULL) unset_local(var_name);
+    else if (set_local(var_name, var_assignment) < 0)
     {
-        perror("realloc");
         return_var = -1;
-    } 
+        return;
+    }
 
-    // Duplicate string to list with strdup
-    local_variables[num_local_variables].name = strdup(var_name);
-    local_variables[num_local_variables].value = strdup(var_assignment);
-    num_local_variables++;
+    return_var = 0;
 }
 /*
  * Vars will print all of the local variables and their values in the format <var>=<value>, 
@@ -218,35 +746,350 @@ void wsh_local(char **args)
  * Updates to existing variables will modify them in-place in the variable list,
  * without moving them around in the list.
  */
-void wsh_vars()
+void wsh_vars(char **args)
 {
+    (void)args;
+
     for (int i = 0; i < num_local_variables; i++)
     {
+        // Skip removed variables
+        if (local_variables[i].name == NULL) continue;
         printf("%s=%s\n", local_variables[i].name, local_variables[i].value);
     }
     return_var = 0;
 }
 /*
- * Keeps track of the last 5 commands, history shows the history list. 
- * Commands executeed more than once consecutively appear in the stored list once.
- * Most recent command is #1. Builtin commands should not be stored in history
- * Length of history is configurable, using history set <n>, where n is an integer.
- * If there are fewer commands in the history than its capacity, simply print the commands that are stored 
- * If a larger history is shrunk using history set, drop the commands which no longer fit into the history
- * To execute a command from the history, use history <n>, where n is the nth command in history.
+ * Returns the nth most recent history entry (1 is the newest), or NULL if there is none
  */
-void wsh_history(char **args) 
+char *history_get(int n)
 {
-    // Display history
-    if (args[1] == NULL) 
-    {
-        for (int i = 0; i < history_list_size; i++) 
-        {
-            if (history_list[i] != NULL) 
+    if (n < 1 || n > history_count) return NULL;
+    return history_list[(history_head - n + history_list_size) % history_list_size].line;
+}
+
+/*
+ * Changes the history capacity, keeping the newest entries that still fit.
+ * Kept strings are handed over as they are, only dropped ones are freed.
+ */
+int history_resize(int new_size)
+{
+    HistoryEntry *resized = calloc(new_size, sizeof(HistoryEntry));
+    if (resized == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    // Oldest kept entry goes to slot 0, the newest to slot kept - 1
+    int kept = (history_count < new_size) ? history_count : new_size;
+    for (int n = 1; n <= history_count; n++)
+    {
+        HistoryEntry *entry = &history_list[(history_head - n + history_list_size) % history_list_size];
+        if (n <= kept) resized[kept - n] = *entry;
+        else free(entry->line);
+    }
+
+    // Spare buffers in slots that never held a live entry
+    for (int i = history_count; i < history_list_size; i++) free(history_list[(history_head + i - history_count + history_list_size) % history_list_size].line);
+
+    free(history_list);
+    history_list = resized;
+    history_list_size = new_size;
+    history_count = kept;
+    history_head = kept % new_size;
+    return 0;
+}
+
+/*
+ * Opens the persistent history file for an interactive session: $WSH_HISTFILE, or ~/.wsh_history.
+ * An empty WSH_HISTFILE keeps history in memory only. The list starts with the file's newest lines.
+ */
+void history_open()
+{
+    char path[PATH_MAX];
+    const char *file = getenv("WSH_HISTFILE");
+    const char *home = getenv("HOME");
+    if (file != NULL)
+    {
+        if (file[0] == '\0') return;
+        snprintf(path, sizeof(path), "%s", file);
+    }
+    else if (home != NULL && home[0] != '\0') snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE_NAME);
+    else return;
+
+    // Every session appends to the same file, O_APPEND keeps each entry's write whole
+    history_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history_fd < 0)
+    {
+        perror(path);
+        return;
+    }
+
+    flock(history_fd, LOCK_SH);
+    int mapped = history_map_refresh();
+    flock(history_fd, LOCK_UN);
+    if (mapped < 0 || history_index.map == NULL) return;
+
+    // Walk back over the newest complete lines, then add them oldest first
+    const char *map = history_index.map;
+    size_t end = history_index.map_len;
+    while (end > 0 && map[end - 1] != '\n') end--;
+    size_t start = end;
+    for (int n = 0; n < history_list_size && start > 0; n++)
+    {
+        const char *newline = (start > 1) ? memrchr(map, '\n', start - 1) : NULL;
+        start = (newline != NULL) ? (size_t)(newline - map) + 1 : 0;
+    }
+    while (start < end)
+    {
+        const char *newline = memchr(map + start, '\n', end - start);
+        size_t len = newline - (map + start);
+        if (len > 0) history_push(map + start, len);
+        start += len + 1;
+    }
+}
+
+/*
+ * Maps the history file as it is now, again if it grew since the last look.
+ * A file that shrank was replaced, so its index starts over. Returns 0, or -1 if it cannot be mapped.
+ */
+int history_map_refresh()
+{
+    HistoryIndex *index = &history_index;
+    struct stat st;
+    if (history_fd < 0 || fstat(history_fd, &st) < 0) return -1;
+
+    if ((size_t)st.st_size < index->indexed) history_index_reset();
+    if ((size_t)st.st_size == index->map_len) return 0;
+
+    if (index->map != NULL) munmap(index->map, index->map_len);
+    index->map = NULL;
+    index->map_len = 0;
+    if (st.st_size == 0) return 0;
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    index->map = map;
+    index->map_len = st.st_size;
+    return 0;
+}
+
+/*
+ * Bucket of the trigram at s, the index keeps one list of line numbers per bucket
+ */
+uint32_t trigram_bucket(const char *s)
+{
+    uint32_t trigram = ((uint32_t)(unsigned char)s[0] << 16) | ((uint32_t)(unsigned char)s[1] << 8) | (unsigned char)s[2];
+    return (trigram * 2654435761u) >> (32 - HISTORY_INDEX_BITS);
+}
+
+/*
+ * Drops everything indexed so far
+ */
+void history_index_reset()
+{
+    HistoryIndex *index = &history_index;
+    if (index->postings != NULL)
+    {
+        for (uint32_t i = 0; i < HISTORY_INDEX_BUCKETS; i++) free(index->postings[i].ids);
+        free(index->postings);
+    }
+    free(index->lines);
+    index->postings = NULL;
+    index->lines = NULL;
+    index->nlines = 0;
+    index->lines_cap = 0;
+    index->indexed = 0;
+}
+
+/*
+ * Brings the trigram index up to date with the history file, indexing only the complete lines
+ * added since the last update, by this session or any other
+ */
+void history_index_update()
+{
+    HistoryIndex *index = &history_index;
+    flock(history_fd, LOCK_SH);
+    int mapped = history_map_refresh();
+    flock(history_fd, LOCK_UN);
+    if (mapped < 0) return;
+
+    if (index->postings == NULL)
+    {
+        index->postings = calloc(HISTORY_INDEX_BUCKETS, sizeof(HistoryPostings));
+        if (index->postings == NULL)
+        {
+            perror("calloc");
+            exit(-1);
+        }
+    }
+
+    const char *map = index->map;
+    size_t pos = index->indexed;
+    while (pos < index->map_len)
+    {
+        // A line without its newline is still being written
+        const char *newline = memchr(map + pos, '\n', index->map_len - pos);
+        if (newline == NULL) break;
+        size_t len = newline - (map + pos);
+
+        uint32_t id = index->nlines;
+        index->lines = grow_array(index->lines, index->nlines, &index->lines_cap, sizeof(uint64_t));
+        index->lines[index->nlines++] = pos;
+
+        // Each line is listed once per bucket, in increasing order
+        for (size_t i = 0; i + 3 <= len; i++)
+        {
+            HistoryPostings *list = &index->postings[trigram_bucket(map + pos + i)];
+            if (list->count > 0 && list->ids[list->count - 1] == id) continue;
+            list->ids = grow_array(list->ids, list->count, &list->cap, sizeof(uint32_t));
+            list->ids[list->count++] = id;
+        }
+        pos += len + 1;
+    }
+    index->indexed = pos;
+}
+
+/*
+ * Returns indexed line id of the history file, setting *len to its length without the newline
+ */
+const char *history_line(uint32_t id, size_t *len)
+{
+    HistoryIndex *index = &history_index;
+    const char *start = index->map + index->lines[id];
+    const char *newline = memchr(start, '\n', index->map_len - index->lines[id]);
+    *len = newline - start;
+    return start;
+}
+
+/*
+ * Finds the newest history entry containing query that is older than the one *cursor points at,
+ * starting from the newest when *cursor is UINT32_MAX. Searches the history file through its trigram
+ * index, checking only the lines listed under the query's rarest trigram, or the in-memory list
+ * when history is not persisted. Returns 1 with the entry in *match and *len, or 0 if there is none.
+ */
+int history_search_next(const char *query, uint32_t *cursor, const char **match, size_t *len)
+{
+    size_t query_len = strlen(query);
+
+    // In-memory list, where *cursor is the last entry number checked
+    if (history_fd < 0)
+    {
+        for (int n = (*cursor == UINT32_MAX) ? 1 : (int)*cursor + 1; n <= history_count; n++)
+        {
+            char *entry = history_get(n);
+            if (strstr(entry, query) != NULL)
+            {
+                *cursor = n;
+                *match = entry;
+                *len = strlen(entry);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    HistoryIndex *index = &history_index;
+    if (index->postings == NULL) return 0;
+    uint32_t below = (*cursor < index->nlines) ? *cursor : index->nlines;
+
+    // Queries too short for a trigram check every line
+    if (query_len < 3)
+    {
+        for (uint32_t id = below; id-- > 0;)
+        {
+            const char *text = history_line(id, len);
+            if (memmem(text, *len, query, query_len) != NULL)
             {
-                printf("%d) %s\n", i + 1, history_list[i]);
+                *cursor = id;
+                *match = text;
+                return 1;
             }
         }
+        return 0;
+    }
+
+    HistoryPostings *rarest = NULL;
+    for (size_t i = 0; i + 3 <= query_len; i++)
+    {
+        HistoryPostings *list = &index->postings[trigram_bucket(query + i)];
+        if (rarest == NULL || list->count < rarest->count) rarest = list;
+    }
+
+    // The list is sorted, so binary search for the entries older than the cursor and walk back from there
+    uint32_t low = 0;
+    uint32_t high = rarest->count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (rarest->ids[mid] < below) low = mid + 1;
+        else high = mid;
+    }
+    for (uint32_t k = low; k-- > 0;)
+    {
+        uint32_t id = rarest->ids[k];
+        const char *text = history_line(id, len);
+        if (memmem(text, *len, query, query_len) != NULL)
+        {
+            *cursor = id;
+            *match = text;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Appends the len bytes of entry to the history file under an exclusive lock, so concurrent sessions never interleave
+ */
+void history_append(const char *entry, size_t len)
+{
+    struct iovec parts[2];
+    parts[0].iov_base = (void *)entry;
+    parts[0].iov_len = len;
+    parts[1].iov_base = "\n";
+    parts[1].iov_len = 1;
+
+    flock(history_fd, LOCK_EX);
+    if (writev(history_fd, parts, 2) < 0) perror("history");
+    flock(history_fd, LOCK_UN);
+}
+
+/*
+ * Closes the history file and frees its index
+ */
+void history_close()
+{
+    history_index_reset();
+    if (history_index.map != NULL) munmap(history_index.map, history_index.map_len);
+    history_index.map = NULL;
+    history_index.map_len = 0;
+    if (history_fd >= 0) close(history_fd);
+    history_fd = -1;
+}
+
+/*
+ * Keeps track of the last 5 commands, history shows the history list. 
+ * Commands executeed more than once consecutively appear in the stored list once.
+ * Most recent command is #1. Builtin commands should not be stored in history
+ * Length of history is configurable, using history set <n>, where n is an integer.
+ * If there are fewer commands in the history than its capacity, simply print the commands that are stored 
+ * If a larger history is shrunk using history set, drop the commands which no longer fit into the history
+ * To execute a command from the history, use history <n>, where n is the nth command in history.
+ */
+void wsh_history(char **args) 
+{
+    // Display history
+    if (args[1] == NULL) 
+    {
+        for (int i = 1; i <= history_count; i++) 
+        {
+            printf("%d) %s\n", i, history_get(i));
+        }
     }
     // "history set <n>" changes length of history list
     else if (args[1] != NULL && strcmp(args[1], "set") == 0 && args[2] != NULL && isdigit(args[2][0])) {
@@ -254,39 +1097,11 @@ void wsh_history(char **args)
         int new_size = atoi(args[2]);
         if (new_size > 0) 
         {
-            // If shrinking the history list
-            if (new_size < history_list_size) 
-            {
-                // Free the entries that are beyond the new size
-                for (int i = new_size; i < history_list_size; i++) 
-                {
-                    if (history_list[i] != NULL) 
-                    {
-                        free(history_list[i]);
-                    }
-                }
-            }
-
-            // Adjust the history list size with realloc
-            history_list = realloc(history_list, new_size * sizeof(char *));
-            if (history_list == NULL) 
+            if (history_resize(new_size) < 0)
             {
-                perror("realloc");
                 return_var = -1;
                 return;
             }
-
-            // Initialize new entries to NULL if expanding
-            if (new_size > history_list_size) 
-            {
-                for (int i = history_list_size; i < new_size; i++) 
-                {
-                     history_list[i] = NULL;
-                }
-            }
-
-        // Update the history list size to the new size
-        history_list_size = new_size;
         } 
         else 
         {
@@ -295,42 +1110,49 @@ void wsh_history(char **args)
         }
     }
 
+    // "history search <text>" prints the entries containing the text, newest first
+    else if (strcmp(args[1], "search") == 0 && args[2] != NULL)
+    {
+        size_t query_len = 0;
+        for (int i = 2; args[i] != NULL; i++) query_len += strlen(args[i]) + 1;
+        char *query = arena_alloc(&line_arena, query_len);
+        query[0] = '\0';
+        for (int i = 2; args[i] != NULL; i++)
+        {
+            if (i > 2) strcat(query, " ");
+            strcat(query, args[i]);
+        }
+
+        if (history_fd >= 0) history_index_update();
+        uint32_t cursor = UINT32_MAX;
+        const char *match;
+        size_t len;
+        int found = 0;
+        while (history_search_next(query, &cursor, &match, &len))
+        {
+            printf("%.*s\n", (int)len, match);
+            found = 1;
+        }
+        return_var = found ? 0 : 1;
+        return;
+    }
+
     // Otherwise if history <n>, access the nth command
     else if (isdigit(args[1][0])) 
     {   
         // Execute command from that index given
-        int index = atoi(args[1]) - 1;  // Convert argument to int, subtract 1 to match 0-indexed array
+        char *entry = history_get(atoi(args[1]));
 
         // Check if index is within bounds and there's a command in the history
-        if (index >= 0 && index < history_list_size && history_list[index] != NULL)
+        if (entry != NULL)
         {
-            // Copy command from history using strdup
-            char *command = strdup(history_list[index]);
-            if (command == NULL) 
-            {
-                perror("strdup");
-                return_var = -1;
-                return;
-            }
-
-            // Create a temporary args array to avoid overwriting the original args
-            char *temp_args[MAXARGS];
-            char *token = strtok(command, " ");
-            int i = 0;
-
-            // Reset temp_args and fill it with the tokens
-            while (token != NULL)
-            {
-                temp_args[i++] = token;
-                token = strtok(NULL, " ");
-            }
-            temp_args[i] = NULL; // Null terminate the temp_args array
+            // Lex the command from history again, so variables expand to their current values.
+            // The entry is copied since running it may replace history entries.
+            size_t len = strlen(entry);
+            char *command = arena_strndup(&line_arena, entry, len);
 
-            // Execute the command using execute_commands without recording in history
-            execute_commands(temp_args, NULL, 1);
-
-            // Free the duplicated command string
-            free(command);
+            // Execute the command without recording in history
+            execute_text(command, command + len, 1);
         }
         else 
         {
@@ -343,564 +1165,5516 @@ void wsh_history(char **args)
     return_var = 0;
 }
 
+// One name for ls, with its first 8 bytes packed big-endian so most comparisons skip strcmp
+typedef struct LsEntry
+{
+    uint64_t prefix;
+    const char *name;
+} LsEntry;
+
+/*
+ * qsort comparator for ls, byte order like LANG=C
+ */
+int ls_compare(const void *a, const void *b)
+{
+    const LsEntry *x = a;
+    const LsEntry *y = b;
+    if (x->prefix != y->prefix) return (x->prefix < y->prefix) ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * Writes len bytes to fd, retrying short writes
+ */
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
 /*
  * ls: Produces the same output as LANG=C ls -1, 
  * however you cannot spawn ls program because this is a built-in. 
  * This built-in does not implement any parameters.
+ * Entries are read in large getdents64 batches into one growing arena of names,
+ * sorted with qsort, and written out in large chunks.
  */
-void wsh_ls() {
-    DIR *dir;                   // Pointer to a directory stream
-    struct dirent *entry;        // Pointer to a directory entry structure
-    char **file_list = NULL;     // Array of strings to hold file names
-    int file_count = 0;          // Number of files in the directory
-    int max_files = 10;          // Initial size for dynamic array
+void wsh_ls(char **args)
+{
+    (void)args;
 
     // Open the current directory (".")
-    dir = opendir(".");
-
-    if (dir == NULL) 
+    int dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) 
     {
         perror("opendir");
         return_var = -1;
         return;
     }
 
-    // Allocate memory for the file list
-    file_list = malloc(max_files * sizeof(char *));
-    if (file_list == NULL) 
+    // Arena of NUL-terminated names, and their offsets into it
+    char *names = NULL;
+    size_t names_len = 0, names_cap = 0;
+    size_t *offsets = NULL;
+    size_t file_count = 0, offsets_cap = 0;
+    char *batch = malloc(LS_BATCH_SIZE);
+    if (batch == NULL)
     {
         perror("malloc");
-        // Close directory, else memory leak
-        closedir(dir);
+        close(dir_fd);
         return_var = -1;
         return;
     }
 
-    // Read directory entries one by one using readdir
-    while ((entry = readdir(dir)) != NULL) // readdir returns pointer to next directory entry
+    // Read directory entries a batch at a time
+    ssize_t nread;
+    while ((nread = getdents64(dir_fd, batch, LS_BATCH_SIZE)) > 0)
     {
-        // Skip hidden files or directories
-        if (entry->d_name[0] == '.') continue;
-
-        // Check if we need to resize the file_list array
-        if (file_count >= max_files) 
+        for (ssize_t pos = 0; pos < nread; )
         {
-            max_files = max_files * 2; // Double the size of the array
+            struct dirent64 *entry = (struct dirent64 *)(batch + pos);
+            pos += entry->d_reclen;
 
-            // Realloc list with new size
-            file_list = realloc(file_list, max_files * sizeof(char *));
-            if (file_list == NULL) 
+            // Skip hidden files or directories
+            if (entry->d_name[0] == '.') continue;
+
+            size_t len = strlen(entry->d_name) + 1;
+            if (names_len + len > names_cap)
             {
-                perror("realloc");
-                closedir(dir);
-                return_var = -1;
-                return;
+                names_cap = (names_cap > 0) ? names_cap * 2 : LS_BATCH_SIZE;
+                while (names_len + len > names_cap) names_cap *= 2;
+                char *grown = realloc(names, names_cap);
+                if (grown == NULL) goto out_of_memory;
+                names = grown;
+            }
+            if (file_count == offsets_cap)
+            {
+                offsets_cap = (offsets_cap > 0) ? offsets_cap * 2 : 1024;
+                size_t *grown = realloc(offsets, offsets_cap * sizeof(size_t));
+                if (grown == NULL) goto out_of_memory;
+                offsets = grown;
             }
-        }
 
-        // Store the file name by copying it from directory entry with strdup
-        file_list[file_count] = strdup(entry->d_name);  
-        if (file_list[file_count] == NULL) 
-        {
-            perror("strdup");
-            closedir(dir);
-            return_var = -1;
-            return;
+            memcpy(names + names_len, entry->d_name, len);
+            offsets[file_count++] = names_len;
+            names_len += len;
         }
-        file_count++;
     }
+    if (nread < 0) perror("getdents64");
 
     // Close the directory
-    closedir(dir);
+    close(dir_fd);
+    free(batch);
+    batch = NULL;
 
-    // Sort file names by alphabet
-    // Bubble sort??? IDK, from stackoverflow
-    for (int i = 0; i < file_count - 1; i++) {
-        for (int j = 0; j < file_count - i - 1; j++) {
-            if (strcmp(file_list[j], file_list[j + 1]) > 0) 
-            {
-                // Swap the file names
-                char *temp = file_list[j];
-                file_list[j] = file_list[j + 1];
-                file_list[j + 1] = temp;
-            }
-        }
+    // Sort file names in byte order
+    LsEntry *list = malloc((file_count > 0 ? file_count : 1) * sizeof(LsEntry));
+    if (list == NULL) goto out_of_memory;
+    for (size_t i = 0; i < file_count; i++)
+    {
+        const char *name = names + offsets[i];
+        uint64_t prefix = 0;
+        for (int b = 0; b < 8 && name[b] != '\0'; b++) prefix |= (uint64_t)(unsigned char)name[b] << (56 - 8 * b);
+        list[i].prefix = prefix;
+        list[i].name = name;
     }
+    qsort(list, file_count, sizeof(LsEntry), ls_compare);
 
-    // Print the list
-    for (int i = 0; i < file_count; i++) 
+    // Print the list in large chunks, after anything already buffered on stdout
+    fflush(stdout);
+    char *out = malloc(LS_BATCH_SIZE);
+    if (out == NULL)
+    {
+        perror("malloc");
+        free(list);
+        free(offsets);
+        free(names);
+        return_var = -1;
+        return;
+    }
+    size_t out_len = 0;
+    return_var = 0;
+    for (size_t i = 0; i < file_count; i++)
+    {
+        size_t len = strlen(list[i].name);
+        if (out_len + len + 1 > LS_BATCH_SIZE)
+        {
+            if (write_all(STDOUT_FILENO, out, out_len) < 0) break;
+            out_len = 0;
+        }
+        // Names longer than the buffer are written directly
+        if (len + 1 > LS_BATCH_SIZE)
+        {
+            if (write_all(STDOUT_FILENO, list[i].name, len) < 0 || write_all(STDOUT_FILENO, "\n", 1) < 0) break;
+            continue;
+        }
+        memcpy(out + out_len, list[i].name, len);
+        out[out_len + len] = '\n';
+        out_len += len + 1;
+    }
+    if (write_all(STDOUT_FILENO, out, out_len) < 0)
     {
-        printf("%s\n", file_list[i]);
-        free(file_list[i]);  // Free after printing
+        perror("write");
+        return_var = -1;
     }
 
-    // Free array when dnone
-    free(file_list);
+    // Free arrays when done
+    free(out);
+    free(list);
+    free(offsets);
+    free(names);
+    return;
 
-    return_var = 0;
+out_of_memory:
+    perror("malloc");
+    if (batch != NULL) close(dir_fd);
+    free(batch);
+    free(offsets);
+    free(names);
+    return_var = -1;
 }
-   
 
-void execute_commands(char **args, char *original_line, int from_history)
+/*
+ * hash: Lists the remembered command locations as <hits> <command> <path>.
+ * hash -r forgets every remembered location, and hash <cmd>... looks each command
+ * up in $PATH and remembers it ahead of time.
+ */
+void wsh_hash(char **args)
 {
-    // Check for redirections in commands //
-    // For file redirections
-    FILE *input;
-    FILE *output;
-    // Save stdin, stdout, and stderr for restore after commands sent
-    int saved_stdin = dup(STDIN_FILENO);
-    int saved_stdout = dup(STDOUT_FILENO);
-    int saved_stderr = dup(STDERR_FILENO);
-    int i = 0;
-    int cmd_executed = 0;
-    int fd;
+    return_var = 0;
 
-    while(args[i] != NULL)
+    // List the cache
+    if (args[1] == NULL)
     {
-        if (strstr(args[i], "<") != NULL) 
+        for (int i = 0; i < CMD_HASH_BUCKETS; i++)
         {
-            fd = STDIN_FILENO;  // Default to stdin
-            char *filename;
-
-            // Check if there's a digit before '<'
-            if (args[i][0] >= '0' && args[i][0] <= '9' && args[i][1] == '<') 
-            {
-                fd = args[i][0] - '0';  // Use the digit before '<' as file descriptor
-                filename = strtok(args[i] + 2, " ");  // Get the filename after '<'
-            } 
-            else 
-            {
-                filename = strtok(args[i], "<");  // Get the filename after '<'
-            }
-
-            // Open the file for reading
-            input = fopen(filename, "r");
-            if (input != NULL) 
+            for (CmdHashEntry *entry = cmd_hash[i]; entry != NULL; entry = entry->next)
             {
-                dup2(fileno(input), fd);  // Duplicate the file descriptor to redirect input
-                fclose(input);
-                args[i] = NULL;
+                printf("%d\t%s\t%s\n", entry->hits, entry->name, entry->path);
             }
-            else 
+        }
+    }
+    // Clear the cache
+    else if (strcmp(args[1], "-r") == 0)
+    {
+        hash_clear();
+    }
+    // Pre-seed the cache
+    else
+    {
+        for (int i = 1; args[i] != NULL; i++)
+        {
+            if (lookup_command(args[i]) == NULL)
             {
-                perror("fopen");
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
                 return_var = -1;
             }
         }
-        // Redirect output and append to file and error
-        else if (strstr(args[i], "&>>") != NULL)
-        {
-            output = fopen(strtok(args[i], "&>>"), "a");
-            dup2(fileno(output), STDOUT_FILENO);
-            dup2(fileno(output), STDERR_FILENO);
-            fclose(output); 
-            args[i] = NULL;
-        }
-        // Redirect output and append to end of file
-        else if (strstr(args[i], ">>") != NULL) 
+    }
+}
+
+/*
+ * echo: Writes its arguments separated by spaces, -n leaves off the trailing newline
+ */
+void wsh_echo(char **args)
+{
+    int i = 1;
+    int newline = 1;
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0)
+    {
+        newline = 0;
+        i++;
+    }
+
+    for (int first = i; args[i] != NULL; i++)
+    {
+        if (i > first) putchar(' ');
+        fputs(args[i], stdout);
+    }
+    if (newline) putchar('\n');
+    return_var = 0;
+}
+
+/*
+ * true: Does nothing, successfully
+ */
+void wsh_true(char **args)
+{
+    (void)args;
+    return_var = 0;
+}
+
+/*
+ * false: Does nothing, unsuccessfully
+ */
+void wsh_false(char **args)
+{
+    (void)args;
+    return_var = 1;
+}
+
+/*
+ * Parses a test operand as an integer, returns -1 after reporting if it is not one
+ */
+int test_integer(const char *arg, long *value)
+{
+    char *end;
+    errno = 0;
+    *value = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno != 0)
+    {
+        fprintf(stderr, "test: %s: integer expression expected\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Evaluates a test expression of argc words.
+ * Returns 0 if it is true, 1 if it is false and 2 if it is malformed.
+ */
+int test_eval(char **argv, int argc)
+{
+    if (argc == 0) return 1;
+
+    // ! negates the rest of the expression
+    if (strcmp(argv[0], "!") == 0)
+    {
+        int result = test_eval(argv + 1, argc - 1);
+        return (result == 2) ? 2 : !result;
+    }
+
+    // A lone word is true when it is not empty
+    if (argc == 1) return argv[0][0] == '\0';
+
+    // Unary operators on strings and files
+    if (argc == 2)
+    {
+        const char *op = argv[0];
+        const char *arg = argv[1];
+        struct stat st;
+
+        if (strcmp(op, "-z") == 0) return arg[0] != '\0';
+        if (strcmp(op, "-n") == 0) return arg[0] == '\0';
+        if (strcmp(op, "-r") == 0) return access(arg, R_OK) != 0;
+        if (strcmp(op, "-w") == 0) return access(arg, W_OK) != 0;
+        if (strcmp(op, "-x") == 0) return access(arg, X_OK) != 0;
+        if (strcmp(op, "-e") == 0) return stat(arg, &st) != 0;
+        if (strcmp(op, "-f") == 0) return stat(arg, &st) != 0 || !S_ISREG(st.st_mode);
+        if (strcmp(op, "-d") == 0) return stat(arg, &st) != 0 || !S_ISDIR(st.st_mode);
+        if (strcmp(op, "-s") == 0) return stat(arg, &st) != 0 || st.st_size == 0;
+        if (strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0) return lstat(arg, &st) != 0 || !S_ISLNK(st.st_mode);
+
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+
+    // Binary operators on strings and integers
+    if (argc == 3)
+    {
+        const char *op = argv[1];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(argv[0], argv[2]) != 0;
+        if (strcmp(op, "!=") == 0) return strcmp(argv[0], argv[2]) == 0;
+
+        static const char *int_ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+        for (int i = 0; i < 6; i++)
+        {
+            if (strcmp(op, int_ops[i]) != 0) continue;
+
+            long a, b;
+            if (test_integer(argv[0], &a) < 0 || test_integer(argv[2], &b) < 0) return 2;
+            switch (i)
+            {
+                case 0: return !(a == b);
+                case 1: return !(a != b);
+                case 2: return !(a < b);
+                case 3: return !(a <= b);
+                case 4: return !(a > b);
+                default: return !(a >= b);
+            }
+        }
+
+        fprintf(stderr, "test: %s: binary operator expected\n", op);
+        return 2;
+    }
+
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
+}
+
+/*
+ * test / [: Evaluates a string, integer or file test and sets the return value to 0 if it holds,
+ * 1 if it does not and 2 if the expression is malformed. [ needs a closing ].
+ */
+void wsh_test(char **args)
+{
+    int argc = 0;
+    while (args[argc + 1] != NULL) argc++;
+
+    if (strcmp(args[0], "[") == 0)
+    {
+        if (argc == 0 || strcmp(args[argc], "]") != 0)
+        {
+            fprintf(stderr, "[: missing ']'\n");
+            return_var = 2;
+            return;
+        }
+        argc--;
+    }
+
+    return_var = test_eval(args + 1, argc);
+}
+
+/*
+ * Copies in_fd to stdout until EOF. File-to-file copies stay in the kernel through
+ * copy_file_range, falling back to sendfile and then to read/write for pipes and terminals.
+ * Returns 0 on success, -1 with errno set, or -2 if in_fd is the file stdout writes to.
+ */
+int cat_fd(int in_fd)
+{
+    enum { COPY_RANGE, SEND_FILE, READ_WRITE } mode = COPY_RANGE;
+    char buf[64 * 1024];
+
+    // Appending a regular file to itself would never reach EOF
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) == 0 && fstat(STDOUT_FILENO, &out_st) == 0 && S_ISREG(in_st.st_mode)
+        && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino)
+    {
+        errno = EINVAL;
+        return -2;
+    }
+
+    while (1)
+    {
+        ssize_t copied;
+        if (mode == COPY_RANGE)
+        {
+            copied = copy_file_range(in_fd, NULL, STDOUT_FILENO, NULL, CAT_CHUNK_SIZE, 0);
+            // Not both regular files on one filesystem, or stdout is O_APPEND
+            if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == EBADF || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                mode = SEND_FILE;
+                continue;
+            }
+        }
+        else if (mode == SEND_FILE)
+        {
+            copied = sendfile(STDOUT_FILENO, in_fd, NULL, CAT_CHUNK_SIZE);
+            // The input cannot be mapped, e.g. a pipe or a terminal
+            if (copied < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                mode = READ_WRITE;
+                continue;
+            }
+        }
+        else
+        {
+            copied = read(in_fd, buf, sizeof(buf));
+            if (copied > 0 && write_all(STDOUT_FILENO, buf, copied) < 0) return -1;
+        }
+
+        if (copied < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (copied == 0) return 0;
+    }
+}
+
+/*
+ * cat: Writes each file, or stdin when there are none or for -, to stdout
+ */
+void wsh_cat(char **args)
+{
+    return_var = 0;
+
+    // Output buffered by earlier built-ins comes first, everything after goes straight to the descriptor
+    fflush(stdout);
+
+    if (args[1] == NULL)
+    {
+        if (cat_fd(STDIN_FILENO) < 0)
+        {
+            perror("cat");
+            return_var = 1;
+        }
+        return;
+    }
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        int fd = STDIN_FILENO;
+        if (strcmp(args[i], "-") != 0)
+        {
+            fd = open(args[i], O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+                return_var = 1;
+                continue;
+            }
+        }
+
+        int err = cat_fd(fd);
+        if (err < 0)
+        {
+            if (err == -2) fprintf(stderr, "cat: %s: input file is output file\n", args[i]);
+            else fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+            return_var = 1;
+        }
+        if (fd != STDIN_FILENO) close(fd);
+    }
+}
+
+/*
+ * Writes str to stdout, translating backslash escapes. With stop set, \c ends all output
+ * and 1 is returned so the caller can stop too.
+ */
+int printf_escapes(const char *str, int stop)
+{
+    for (const char *p = str; *p != '\0'; p++)
+    {
+        if (*p != '\\' || p[1] == '\0')
+        {
+            putchar(*p);
+            continue;
+        }
+
+        p++;
+        switch (*p)
+        {
+            case 'n': putchar('\n'); break;
+            case 't': putchar('\t'); break;
+            case 'r': putchar('\r'); break;
+            case 'a': putchar('\a'); break;
+            case 'b': putchar('\b'); break;
+            case 'f': putchar('\f'); break;
+            case 'v': putchar('\v'); break;
+            case 'e': putchar('\033'); break;
+            case '\\': putchar('\\'); break;
+            case 'c':
+                if (stop) return 1;
+                fputs("\\c", stdout);
+                break;
+            case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+            {
+                // Up to three octal digits, \0 may have three more after it
+                int value = 0;
+                int digits = (*p == '0') ? 4 : 3;
+                while (digits-- > 0 && *p >= '0' && *p <= '7') value = value * 8 + (*p++ - '0');
+                p--;
+                putchar(value);
+                break;
+            }
+            default:
+                putchar('\\');
+                putchar(*p);
+        }
+    }
+    return 0;
+}
+
+/*
+ * printf <format> [args...]: Formats args like printf(1). Supports %d %i %u %o %x %X %c %s %b and %%,
+ * with flags, width and precision. The format is reused until every argument is consumed.
+ */
+void wsh_printf(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "printf: usage: printf <format> [args...]\n");
+        return_var = 1;
+        return;
+    }
+
+    return_var = 0;
+    const char *format = args[1];
+    char **arg = args + 2;
+
+    do
+    {
+        char **pass_start = arg;
+        for (const char *p = format; *p != '\0'; p++)
+        {
+            // Literal text runs up to the next conversion
+            if (*p != '%')
+            {
+                const char *next = strchr(p, '%');
+                size_t len = (next != NULL) ? (size_t)(next - p) : strlen(p);
+                char *text = arena_strndup(&line_arena, p, len);
+                printf_escapes(text, 0);
+                p += len - 1;
+                continue;
+            }
+
+            if (p[1] == '%')
+            {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            // Copy the flags, width and precision into a spec for the C printf
+            char spec[32];
+            size_t len = 1;
+            spec[0] = '%';
+            p++;
+            while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL && len < sizeof(spec) - 3) spec[len++] = *p++;
+            if (*p == '\0')
+            {
+                fprintf(stderr, "printf: %s: missing conversion\n", format);
+                return_var = 1;
+                return;
+            }
+
+            // Missing arguments read as empty strings and zeros
+            const char *value = (*arg != NULL) ? *arg++ : "";
+            switch (*p)
+            {
+                case 'd':
+                case 'i':
+                {
+                    char *end;
+                    long long number = strtoll(value, &end, 0);
+                    if (*end != '\0')
+                    {
+                        fprintf(stderr, "printf: %s: invalid number\n", value);
+                        return_var = 1;
+                    }
+                    spec[len++] = 'l';
+                    spec[len++] = 'l';
+                    spec[len++] = *p;
+                    spec[len] = '\0';
+                    printf(spec, number);
+                    break;
+                }
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X':
+                {
+                    char *end;
+                    unsigned long long number = strtoull(value, &end, 0);
+                    if (*end != '\0')
+                    {
+                        fprintf(stderr, "printf: %s: invalid number\n", value);
+                        return_var = 1;
+                    }
+                    spec[len++] = 'l';
+                    spec[len++] = 'l';
+                    spec[len++] = *p;
+                    spec[len] = '\0';
+                    printf(spec, number);
+                    break;
+                }
+                case 'c':
+                    // An empty argument has no character to print, only its padding
+                    if (value[0] == '\0')
+                    {
+                        spec[len++] = 's';
+                        spec[len] = '\0';
+                        printf(spec, "");
+                        break;
+                    }
+                    spec[len++] = 'c';
+                    spec[len] = '\0';
+                    printf(spec, value[0]);
+                    break;
+                case 's':
+                    spec[len++] = 's';
+                    spec[len] = '\0';
+                    printf(spec, value);
+                    break;
+                case 'b':
+                    if (printf_escapes(value, 1)) return;
+                    break;
+                default:
+                    fprintf(stderr, "printf: %%%c: invalid conversion\n", *p);
+                    return_var = 1;
+                    return;
+            }
+        }
+
+        // A format that consumed nothing would repeat forever
+        if (arg == pass_start) break;
+    } while (*arg != NULL);
+}
+
+/*
+ * Saves a copy of every descriptor the redirections will replace, so a built-in's redirections can be undone.
+ * Returns the number of descriptors saved into saved.
+ */
+int save_fds(const Redirect *redirs, int nredirs, SavedFd *saved)
+{
+    // Output buffered so far belongs to the descriptors being replaced
+    fflush(stdout);
+    fflush(stderr);
+
+    int nsaved = 0;
+    for (int i = 0; i < nredirs; i++)
+    {
+        int targets[2] = { redirs[i].fd, redirs[i].both ? STDERR_FILENO : -1 };
+        for (int t = 0; t < 2; t++)
+        {
+            if (targets[t] < 0) continue;
+
+            // Each descriptor only needs saving once
+            int seen = 0;
+            for (int j = 0; j < nsaved; j++) if (saved[j].fd == targets[t]) seen = 1;
+            if (seen) continue;
+
+            // Copies live above the low descriptors and are not inherited by children
+            saved[nsaved].fd = targets[t];
+            saved[nsaved].copy = fcntl(targets[t], F_DUPFD_CLOEXEC, 10);
+            nsaved++;
+        }
+    }
+    return nsaved;
+}
+
+/*
+ * Puts back descriptors saved by save_fds, flushing stdio first since buffered output belongs to the redirection
+ */
+void restore_fds(SavedFd *saved, int nsaved)
+{
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < nsaved; i++)
+    {
+        // A descriptor that was closed before the redirection is closed again
+        if (saved[i].copy < 0)
+        {
+            close(saved[i].fd);
+            continue;
+        }
+        dup2(saved[i].copy, saved[i].fd);
+        close(saved[i].copy);
+    }
+}
+
+/*
+ * Opens and closes each planned redirection, creating or truncating files without moving any descriptor
+ */
+void touch_redirects(const Redirect *redirs, int nredirs)
+{
+    for (int i = 0; i < nredirs; i++)
+    {
+        int fd = open(redirs[i].filename, redirs[i].flags | O_CLOEXEC, 0666);
+        if (fd < 0)
+        {
+            perror("open");
+            return_var = -1;
+            continue;
+        }
+        close(fd);
+    }
+}
+
+/*
+ * Opens each planned redirection and moves it onto its file descriptor in the shell itself.
+ * Used for built-ins, which run in-process and so cannot use spawn file actions.
+ * Returns 0, or -1 if any redirection could not be opened.
+ */
+int apply_redirects(const Redirect *redirs, int nredirs)
+{
+    int status = 0;
+    for (int i = 0; i < nredirs; i++)
+    {
+        int fd = open(redirs[i].filename, redirs[i].flags, 0666);
+        if (fd < 0)
+        {
+            perror("open");
+            return_var = -1;
+            status = -1;
+            continue;
+        }
+        dup2(fd, redirs[i].fd);
+        if (redirs[i].both) dup2(fd, STDERR_FILENO);
+        if (fd != redirs[i].fd) close(fd);
+    }
+    return status;
+}
+
+/*
+ * The single launch primitive for external commands. Starts path with argv through posix_spawn,
+ * which uses CLONE_VFORK so no page tables are copied and the child never runs shell code.
+ * in_fd and out_fd, when not -1, become the child's stdin and stdout (pipeline ends).
+ * Redirections are opened before the spawn, so a failure names the file rather than the command.
+ * pgid -1 keeps the shell's process group, 0 starts a new group and anything else joins that group.
+ * Returns the child's pid, or -1 after reporting why the open or the exec failed.
+ */
+pid_t wsh_spawn(const char *path, char **argv, int in_fd, int out_fd, const Redirect *redirs, int nredirs, pid_t pgid)
+{
+    return wsh_spawn_env(path, argv, environ, in_fd, out_fd, redirs, nredirs, pgid);
+}
+
+/*
+ * wsh_spawn with an explicit environment, used by the zygote
+ */
+pid_t wsh_spawn_env(const char *path, char **argv, char **envp, int in_fd, int out_fd, const Redirect *redirs, int nredirs, pid_t pgid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t pid;
+
+    // Open every target up front, the child then only moves the descriptors into place
+    int *redir_fds = NULL;
+    if (nredirs > 0 && (redir_fds = malloc(nredirs * sizeof(int))) == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 0; i < nredirs; i++)
+    {
+        redir_fds[i] = open(redirs[i].filename, redirs[i].flags | O_CLOEXEC, 0666);
+        if (redir_fds[i] < 0)
+        {
+            perror(redirs[i].filename);
+            for (int j = 0; j < i; j++) close(redir_fds[j]);
+            free(redir_fds);
+            return -1;
+        }
+    }
+
+    // Job control signals the shell ignores go back to their defaults in the child
+    posix_spawnattr_init(&attr);
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (pgid >= 0)
+    {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    posix_spawn_file_actions_init(&actions);
+
+    // Pipeline ends go in first so explicit redirections override them
+    if (in_fd >= 0) posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd >= 0) posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    for (int i = 0; i < nredirs; i++)
+    {
+        posix_spawn_file_actions_adddup2(&actions, redir_fds[i], redirs[i].fd);
+        if (redirs[i].both) posix_spawn_file_actions_adddup2(&actions, redir_fds[i], STDERR_FILENO);
+    }
+
+    // Anything the shell buffered must come out before the child's output
+    fflush(stdout);
+    fflush(stderr);
+
+    // posix_spawn reports exec failures from the child as its return value, the redirections are already open
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    for (int i = 0; i < nredirs; i++) close(redir_fds[i]);
+    free(redir_fds);
+
+    if (err != 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * Runs a built-in in a forked copy of the shell, for pipeline stages and other places a
+ * built-in needs its own process. Takes the same pipe ends, redirections and pgid as wsh_spawn.
+ * Returns the child's pid, or -1 if the fork failed.
+ */
+pid_t spawn_builtin(const Builtin *builtin, char **argv, int in_fd, int out_fd, const Redirect *redirs, int nredirs, pid_t pgid)
+{
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        zygote_detach();
+        if (pgid >= 0) setpgid(0, pgid);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        if (in_fd >= 0) dup2(in_fd, STDIN_FILENO);
+        if (out_fd >= 0) dup2(out_fd, STDOUT_FILENO);
+        apply_redirects(redirs, nredirs);
+        builtin->handler(argv);
+        fflush(stdout);
+        _exit(return_var);
+    }
+    else if (pid < 0) perror("fork");
+
+    return pid;
+}
+
+/*
+ * Compares two environment strings for the zygote's sorted snapshot
+ */
+int env_compare(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Forks the zygote, a helper that creates external commands for the shell. It is started before the
+ * shell allocates anything, so every child it forks copies a tiny address space with a clean signal
+ * and descriptor state, however large the shell grows. The shell keeps a sorted snapshot of the
+ * environment so requests only carry the variables exported since.
+ */
+void zygote_start()
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        perror("socketpair");
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+    close(sv[1]);
+    if (pid < 0)
+    {
+        perror("fork");
+        close(sv[0]);
+        return;
+    }
+
+    int nenv = 0;
+    while (environ[nenv] != NULL) nenv++;
+    zygote_env = malloc((nenv + 1) * sizeof(char *));
+    if (zygote_env == NULL)
+    {
+        perror("malloc");
+        close(sv[0]);
+        return;
+    }
+    for (int i = 0; i < nenv; i++) zygote_env[i] = strdup(environ[i]);
+    zygote_env[nenv] = NULL;
+    qsort(zygote_env, nenv, sizeof(char *), env_compare);
+    zygote_env_count = nenv;
+
+    zygote_fd = sv[0];
+    zygote_pid = pid;
+    zygote_owner = getpid();
+}
+
+/*
+ * Reads exactly len bytes, returns -1 on error or EOF
+ */
+int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0)
+    {
+        ssize_t got = read(fd, p, len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        p += got;
+        len -= got;
+    }
+    return 0;
+}
+
+/*
+ * The zygote's loop: receives a request and the shell's stdin, stdout, stderr and cwd, spawns the
+ * command with the requested redirections and environment, waits for it and sends back its status
+ * and resource usage. Exits when the shell closes its end.
+ */
+void zygote_main(int sock)
+{
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+
+    // Between commands the zygote holds none of the shell's descriptors
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    for (int fd = 0; fd < 3; fd++) dup2(null_fd, fd);
+
+    while (1)
+    {
+        ZygoteRequest req;
+        int fds[ZYGOTE_NFDS];
+        int nfds = 0;
+
+        // The header carries the descriptors
+        union
+        {
+            char buf[CMSG_SPACE(ZYGOTE_NFDS * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov;
+        iov.iov_base = &req;
+        iov.iov_len = sizeof(req);
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) _exit(0);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+        if ((size_t)got < sizeof(req) && read_all(sock, (char *)&req + got, sizeof(req) - got) < 0) _exit(0);
+
+        char *payload = malloc(req.len);
+        if (payload == NULL || read_all(sock, payload, req.len) < 0 || nfds != ZYGOTE_NFDS) _exit(1);
+
+        // Redirections come first, then the path, argv, environment changes and redirection filenames
+        Redirect *redirs = malloc((req.nredirs + 1) * sizeof(Redirect));
+        char **argv = malloc((req.argc + 1) * sizeof(char *));
+        int base = 0;
+        while (environ[base] != NULL) base++;
+        char **envp = malloc((base + req.nenv + 1) * sizeof(char *));
+        if (redirs == NULL || argv == NULL || envp == NULL) _exit(1);
+
+        int32_t *ints = (int32_t *)payload;
+        for (uint32_t i = 0; i < req.nredirs; i++)
+        {
+            redirs[i].fd = ints[3 * i];
+            redirs[i].both = ints[3 * i + 1];
+            redirs[i].flags = ints[3 * i + 2];
+        }
+        char *str = payload + req.nredirs * 3 * sizeof(int32_t);
+        char *path = str;
+        str += strlen(str) + 1;
+        for (uint32_t i = 0; i < req.argc; i++)
+        {
+            argv[i] = str;
+            str += strlen(str) + 1;
+        }
+        argv[req.argc] = NULL;
+
+        // Exported variables replace the zygote's entry of the same name, or are added
+        memcpy(envp, environ, base * sizeof(char *));
+        int nenv = base;
+        for (uint32_t i = 0; i < req.nenv; i++)
+        {
+            size_t name_len = strcspn(str, "=");
+            int j = 0;
+            while (j < nenv && !(strncmp(envp[j], str, name_len) == 0 && envp[j][name_len] == '=')) j++;
+            envp[j] = str;
+            if (j == nenv) nenv++;
+            str += strlen(str) + 1;
+        }
+        envp[nenv] = NULL;
+        for (uint32_t i = 0; i < req.nredirs; i++)
+        {
+            redirs[i].filename = str;
+            str += strlen(str) + 1;
+        }
+
+        // The command runs with the shell's stdio and in the shell's cwd
+        for (int fd = 0; fd < 3; fd++) dup2(fds[fd], fd);
+        if (fchdir(fds[3]) < 0) perror("fchdir");
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+
+        ZygoteReply reply;
+        memset(&reply, 0, sizeof(reply));
+        pid_t pid = wsh_spawn_env(path, argv, envp, -1, -1, redirs, req.nredirs, -1);
+        if (pid > 0)
+        {
+            int status;
+            while (wait4(pid, &status, 0, &reply.usage) < 0 && errno == EINTR);
+            reply.spawned = 1;
+            reply.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        }
+
+        for (int fd = 0; fd < 3; fd++) dup2(null_fd, fd);
+        free(payload);
+        free(redirs);
+        free(argv);
+        free(envp);
+
+        if (write_all(sock, (const char *)&reply, sizeof(reply)) < 0) _exit(1);
+    }
+}
+
+/*
+ * Runs an external command through the zygote and waits for it, adding its resource usage to the
+ * shell's children. Sets *status to the command's return value.
+ * Returns -1 if the zygote is not usable from this process, the caller then spawns it directly.
+ */
+int zygote_run(const char *path, char **argv, const Redirect *redirs, int nredirs, int *status)
+{
+    // Only the process that started the zygote talks to it, and stopped jobs need the shell's own children
+    if (zygote_fd < 0 || job_control || getpid() != zygote_owner) return -1;
+
+    // Only variables exported since the zygote started are sent
+    int argc = 0;
+    while (argv[argc] != NULL) argc++;
+    int nenv = 0;
+    int total_env = 0;
+    while (environ[total_env] != NULL) total_env++;
+    char **changed = arena_alloc(&line_arena, (total_env + 1) * sizeof(char *));
+    for (int i = 0; i < total_env; i++)
+    {
+        if (bsearch(&environ[i], zygote_env, zygote_env_count, sizeof(char *), env_compare) == NULL) changed[nenv++] = environ[i];
+    }
+
+    size_t len = nredirs * 3 * sizeof(int32_t) + strlen(path) + 1;
+    for (int i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+    for (int i = 0; i < nenv; i++) len += strlen(changed[i]) + 1;
+    for (int i = 0; i < nredirs; i++) len += strlen(redirs[i].filename) + 1;
+
+    ZygoteRequest req;
+    req.len = len;
+    req.argc = argc;
+    req.nenv = nenv;
+    req.nredirs = nredirs;
+
+    char *payload = arena_alloc(&line_arena, len);
+    int32_t *ints = (int32_t *)payload;
+    for (int i = 0; i < nredirs; i++)
+    {
+        ints[3 * i] = redirs[i].fd;
+        ints[3 * i + 1] = redirs[i].both;
+        ints[3 * i + 2] = redirs[i].flags;
+    }
+    char *p = payload + nredirs * 3 * sizeof(int32_t);
+    p = stpcpy(p, path) + 1;
+    for (int i = 0; i < argc; i++) p = stpcpy(p, argv[i]) + 1;
+    for (int i = 0; i < nenv; i++) p = stpcpy(p, changed[i]) + 1;
+    for (int i = 0; i < nredirs; i++) p = stpcpy(p, redirs[i].filename) + 1;
+
+    int cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd < 0) return -1;
+    int fds[ZYGOTE_NFDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwd_fd };
+
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov;
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // Anything the shell buffered must come out before the child's output
+    fflush(stdout);
+    fflush(stderr);
+
+    ZygoteReply reply;
+    ssize_t sent = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL);
+    close(cwd_fd);
+    if (sent < 0 || (size_t)sent < sizeof(req)
+        || write_all(zygote_fd, payload, len) < 0
+        || read_all(zygote_fd, &reply, sizeof(reply)) < 0)
+    {
+        // A zygote that went away is not restarted, commands go back to being spawned directly
+        fprintf(stderr, "wsh: zygote lost, spawning directly\n");
+        zygote_stop();
+        return -1;
+    }
+
+    add_rusage(&child_usage, &reply.usage);
+    *status = reply.spawned ? reply.status : -1;
+    return 0;
+}
+
+/*
+ * Closes the zygote's socket, which makes it exit, and reaps it
+ */
+void zygote_stop()
+{
+    if (zygote_fd < 0 || getpid() != zygote_owner) return;
+
+    close(zygote_fd);
+    zygote_fd = -1;
+    waitpid(zygote_pid, NULL, 0);
+    for (int i = 0; i < zygote_env_count; i++) free(zygote_env[i]);
+    free(zygote_env);
+    zygote_env = NULL;
+    zygote_env_count = 0;
+}
+
+/*
+ * Closes a forked copy of the shell's inherited zygote connection, which it never uses.
+ * Otherwise the zygote only sees EOF, and zygote_stop's wait only returns, once every such child has exited.
+ */
+void zygote_detach()
+{
+    if (zygote_fd < 0 || getpid() == zygote_owner) return;
+
+    close(zygote_fd);
+    zygote_fd = -1;
+}
+
+/*
+ * Adds one process's resource usage into a running total, ru_maxrss keeps the largest
+ */
+void add_rusage(struct rusage *total, const struct rusage *usage)
+{
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss) total->ru_maxrss = usage->ru_maxrss;
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/*
+ * Starts measuring a command: wall clock, the shell's own usage and its waited-for children's
+ */
+void measure_begin(Measurement *m)
+{
+    clock_gettime(CLOCK_MONOTONIC, &m->start);
+    getrusage(RUSAGE_SELF, &m->self);
+    m->children = child_usage;
+
+    // Peak RSS cannot be diffed, so the children's peak restarts for this command
+    child_usage.ru_maxrss = 0;
+}
+
+/*
+ * Finishes a measurement into times. Built-ins are charged to the shell, external commands to their processes.
+ */
+void measure_end(Measurement *m, CommandTimes *times)
+{
+    struct timespec end;
+    struct rusage self;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self);
+
+    struct timeval user, sys, child_user, child_sys;
+    timersub(&self.ru_utime, &m->self.ru_utime, &user);
+    timersub(&self.ru_stime, &m->self.ru_stime, &sys);
+    timersub(&child_usage.ru_utime, &m->children.ru_utime, &child_user);
+    timersub(&child_usage.ru_stime, &m->children.ru_stime, &child_sys);
+    timeradd(&user, &child_user, &user);
+    timeradd(&sys, &child_sys, &sys);
+
+    times->real = (end.tv_sec - m->start.tv_sec) + (end.tv_nsec - m->start.tv_nsec) / 1e9;
+    times->user = user.tv_sec + user.tv_usec / 1e6;
+    times->sys = sys.tv_sec + sys.tv_usec / 1e6;
+    times->maxrss = (child_usage.ru_maxrss > 0) ? child_usage.ru_maxrss : self.ru_maxrss;
+    times->minflt = (self.ru_minflt - m->self.ru_minflt) + (child_usage.ru_minflt - m->children.ru_minflt);
+    times->majflt = (self.ru_majflt - m->self.ru_majflt) + (child_usage.ru_majflt - m->children.ru_majflt);
+    times->nvcsw = (self.ru_nvcsw - m->self.ru_nvcsw) + (child_usage.ru_nvcsw - m->children.ru_nvcsw);
+    times->nivcsw = (self.ru_nivcsw - m->self.ru_nivcsw) + (child_usage.ru_nivcsw - m->children.ru_nivcsw);
+
+    // Restore the overall children's peak
+    if (m->children.ru_maxrss > child_usage.ru_maxrss) child_usage.ru_maxrss = m->children.ru_maxrss;
+}
+
+/*
+ * time <cmd>: Runs cmd and reports wall, user and sys time, peak RSS, page faults and context switches on stderr
+ */
+void wsh_time(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "time: usage: time <cmd> [args...]\n");
+        return_var = -1;
+        return;
+    }
+
+    Measurement m;
+    CommandTimes times;
+    measure_begin(&m);
+    execute_commands(words_to_tokens(args + 1), NULL, 0, 1);
+    measure_end(&m, &times);
+
+    fflush(stdout);
+    fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n", times.real, times.user, times.sys);
+    fprintf(stderr, "maxrss\t%ldKB\nfaults\t%ld minor, %ld major\nctxsw\t%ld voluntary, %ld involuntary\n",
+            times.maxrss, times.minflt, times.majflt, times.nvcsw, times.nivcsw);
+}
+
+/*
+ * Parses a signal given as a number or a name, with or without SIG. Returns it, or -1 if it is unknown.
+ */
+int signal_number(const char *name)
+{
+    static const struct { const char *name; int sig; } signals[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL }, { "USR1", SIGUSR1 },
+        { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM }, { "CONT", SIGCONT },
+        { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }
+    };
+
+    if (isdigit((unsigned char)name[0]))
+    {
+        char *end;
+        long sig = strtol(name, &end, 10);
+        return (*end == '\0' && sig > 0 && sig < NSIG) ? (int)sig : -1;
+    }
+
+    if (strncmp(name, "SIG", 3) == 0) name += 3;
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+    {
+        if (strcmp(name, signals[i].name) == 0) return signals[i].sig;
+    }
+    return -1;
+}
+
+/*
+ * Parses a duration in seconds, fractions allowed, with an optional s, m, h or d suffix.
+ * Returns 0, or -1 if it is malformed or negative.
+ */
+int parse_duration(const char *text, struct timespec *duration)
+{
+    char *end;
+    errno = 0;
+    double seconds = strtod(text, &end);
+    if (end == text || errno != 0 || !(seconds >= 0)) return -1;
+
+    if (*end == 'm') seconds *= 60;
+    else if (*end == 'h') seconds *= 60 * 60;
+    else if (*end == 'd') seconds *= 24 * 60 * 60;
+    else if (*end != 's' && *end != '\0') return -1;
+    if (*end != '\0' && end[1] != '\0') return -1;
+
+    // Anything past a century is as good as forever
+    if (seconds > 100.0 * 365 * 24 * 60 * 60) seconds = 100.0 * 365 * 24 * 60 * 60;
+    duration->tv_sec = (time_t)seconds;
+    duration->tv_nsec = (long)((seconds - duration->tv_sec) * 1e9);
+    return 0;
+}
+
+/*
+ * Sleeps until the child pid exits or timeout passes, whichever is first. A NULL timeout waits for the
+ * exit alone. Other children's SIGCHLDs only restart the wait for what is left. Without a pidfd the
+ * SIGCHLD self-pipe wakes the wait instead, and the child is checked with WNOWAIT so it stays unreaped.
+ * Returns 1 if the process exited, 0 on timeout and -1 on error.
+ */
+int wait_child(pid_t pid, int pidfd, const struct timespec *timeout)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout != NULL)
+    {
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    struct pollfd pfd;
+    pfd.fd = (pidfd >= 0) ? pidfd : sigchld_pipe[0];
+    pfd.events = POLLIN;
+    while (1)
+    {
+        if (pidfd < 0)
+        {
+            // Drained pipe bytes leave sigchld_pending set, so the job table still gets reaped later
+            char drain[64];
+            while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0);
+
+            siginfo_t info;
+            info.si_pid = 0;
+            if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0)
+            {
+                perror("waitid");
+                return -1;
+            }
+            if (info.si_pid == pid) return 1;
+        }
+
+        struct timespec left;
+        struct timespec *wait = NULL;
+        if (timeout != NULL)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = deadline.tv_sec - now.tv_sec;
+            left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (left.tv_nsec < 0)
+            {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000L;
+            }
+            if (left.tv_sec < 0) return 0;
+            wait = &left;
+        }
+
+        // With neither a pidfd nor a SIGCHLD pipe there is nothing to wake on, so check again shortly
+        struct timespec slice = { 0, 10000000L };
+        if (pfd.fd < 0 && (wait == NULL || wait->tv_sec > 0 || wait->tv_nsec > slice.tv_nsec)) wait = &slice;
+
+        int ready = ppoll(&pfd, 1, wait, NULL);
+        if (ready > 0 && pidfd >= 0) return 1;
+        if (ready == 0 && wait != &slice) return 0;
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("ppoll");
+            return -1;
+        }
+    }
+}
+
+/*
+ * Sends sig to the child pid, through its pidfd when there is one
+ */
+void signal_child(pid_t pid, int pidfd, int sig)
+{
+    if (pidfd >= 0) syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+    else kill(pid, sig);
+}
+
+/*
+ * timeout [-s SIG] DURATION cmd [args...]: Runs cmd, and if it is still running after DURATION sends it SIG
+ * (TERM by default), then KILL if it outlives that by TIMEOUT_KILL_DELAY seconds. A DURATION of 0 never times out.
+ * The wait sleeps on a pidfd, which keeps referring to the child even if its pid could be reused.
+ * The status is cmd's, or TIMEOUT_STATUS if it had to be stopped.
+ */
+void wsh_timeout(char **args)
+{
+    int sig = SIGTERM;
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-s") == 0)
+    {
+        if (args[i + 1] == NULL || (sig = signal_number(args[i + 1])) < 0)
+        {
+            fprintf(stderr, "timeout: %s: invalid signal\n", (args[i + 1] != NULL) ? args[i + 1] : "");
+            return_var = -1;
+            return;
+        }
+        i += 2;
+    }
+    if (args[i] == NULL || args[i + 1] == NULL)
+    {
+        fprintf(stderr, "timeout: usage: timeout [-s SIG] DURATION <cmd> [args...]\n");
+        return_var = -1;
+        return;
+    }
+
+    struct timespec duration;
+    if (parse_duration(args[i], &duration) < 0)
+    {
+        fprintf(stderr, "timeout: %s: invalid duration\n", args[i]);
+        return_var = -1;
+        return;
+    }
+    char **argv = args + i + 1;
+
+    // Built-ins run in a forked copy of the shell, so they can be stopped like anything else
+    pid_t pid;
+    const Builtin *builtin = find_builtin(argv[0]);
+    if (builtin != NULL) pid = spawn_builtin(builtin, argv, -1, -1, NULL, 0, -1);
+    else
+    {
+        const char *full_path = resolve_command(argv[0]);
+        if (full_path == NULL)
+        {
+            fprintf(stderr, "timeout: %s: command not found\n", argv[0]);
+            return_var = -1;
+            return;
+        }
+        pid = wsh_spawn(full_path, argv, -1, -1, NULL, 0, -1);
+    }
+    if (pid < 0)
+    {
+        return_var = -1;
+        return;
+    }
+
+    // The child stays a zombie until it is waited for below, so its pid cannot be reused before this.
+    // Kernels without pidfd_open fall back to the SIGCHLD self-pipe, the deadline holds either way.
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+    int timed_out = 0;
+    int no_deadline = (duration.tv_sec == 0 && duration.tv_nsec == 0);
+    int waited = wait_child(pid, pidfd, no_deadline ? NULL : &duration);
+    if (waited < 0)
+    {
+        // Without a way to wait there is no way to honour the deadline, so stop the child now
+        signal_child(pid, pidfd, SIGKILL);
+        if (pidfd >= 0) close(pidfd);
+        waitpid(pid, NULL, 0);
+        return_var = -1;
+        return;
+    }
+    if (waited == 0)
+    {
+        timed_out = 1;
+        signal_child(pid, pidfd, sig);
+
+        struct timespec grace;
+        grace.tv_sec = TIMEOUT_KILL_DELAY;
+        grace.tv_nsec = 0;
+        if (sig != SIGKILL && wait_child(pid, pidfd, &grace) != 1) signal_child(pid, pidfd, SIGKILL);
+    }
+    if (pidfd >= 0) close(pidfd);
+
+    pid_t *pids = malloc(sizeof(pid_t));
+    if (pids == NULL)
+    {
+        perror("malloc");
+        waitpid(pid, NULL, 0);
+        return_var = -1;
+        return;
+    }
+    pids[0] = pid;
+    return_var = wait_foreground(pids, 1, argv[0], strlen(argv[0]));
+    if (timed_out) return_var = TIMEOUT_STATUS;
+}
+
+/*
+ * Appends one timelog record: real user sys maxrss_kb minflt majflt nvcsw nivcsw status command, tab separated
+ */
+void write_timelog(const CommandTimes *times, const char *command)
+{
+    char record[256];
+    int len = snprintf(record, sizeof(record), "%.6f\t%.6f\t%.6f\t%ld\t%ld\t%ld\t%ld\t%ld\t%d\t",
+                       times->real, times->user, times->sys, times->maxrss, times->minflt, times->majflt,
+                       times->nvcsw, times->nivcsw, return_var);
+
+    // One writev per record, so O_APPEND keeps concurrent writers' records whole
+    struct iovec iov[3];
+    iov[0].iov_base = record;
+    iov[0].iov_len = len;
+    iov[1].iov_base = (void *)command;
+    iov[1].iov_len = strlen(command);
+    iov[2].iov_base = "\n";
+    iov[2].iov_len = 1;
+    if (writev(timelog_fd, iov, 3) < 0) perror("timelog");
+}
+
+/*
+ * Blocks until stdin is readable, reaping jobs whenever SIGCHLD arrives in the meantime
+ */
+void wait_for_input()
+{
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = sigchld_pipe[0];
+    fds[1].events = POLLIN;
+
+    while (1)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (fds[1].revents & POLLIN) reap_jobs();
+        if (fds[0].revents) return;
+    }
+}
+
+/*
+ * SIGCHLD handler, wakes up the input loop through the self-pipe so finished jobs get reaped
+ */
+void sigchld_handler(int sig)
+{
+    (void)sig;
+    int saved_errno = errno;
+    sigchld_pending = 1;
+    if (sigchld_pipe[1] >= 0 && write(sigchld_pipe[1], "", 1) < 0) { /* pipe full, already pending */ }
+    errno = saved_errno;
+}
+
+/*
+ * Sets up the SIGCHLD self-pipe, and in an interactive terminal ignores the job control stop signals
+ */
+void init_jobs()
+{
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) perror("pipe");
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (job_control)
+    {
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+    }
+}
+
+/*
+ * Joins tokens with spaces, the command text shown for a job
+ */
+char *join_tokens(const Token *tokens)
+{
+    size_t len = 1;
+    for (int i = 0; tokens[i].type != TOK_END; i++)
+    {
+        len += strlen(tokens[i].text) + 1;
+        if (tokens[i].type == TOK_REDIR) len += strlen(tokens[i].redir.filename);
+    }
+
+    char *command = malloc(len);
+    if (command == NULL) return NULL;
+    command[0] = '\0';
+    for (int i = 0; tokens[i].type != TOK_END; i++)
+    {
+        if (i > 0) strcat(command, " ");
+        strcat(command, tokens[i].text);
+        if (tokens[i].type == TOK_REDIR) strcat(command, tokens[i].redir.filename);
+    }
+    return command;
+}
+
+/*
+ * Copies a job into the job table with the next free id, returns the stored job
+ */
+Job *add_job(Job *job)
+{
+    Job *grown = realloc(jobs, (num_jobs + 1) * sizeof(Job));
+    if (grown == NULL)
+    {
+        perror("realloc");
+        return NULL;
+    }
+    jobs = grown;
+
+    job->id = (num_jobs > 0) ? jobs[num_jobs - 1].id + 1 : 1;
+    jobs[num_jobs] = *job;
+    return &jobs[num_jobs++];
+}
+
+/*
+ * Removes a job from the table, keeping the others in order
+ */
+void remove_job(Job *job)
+{
+    int index = job - jobs;
+    free(job->pids);
+    free(job->command);
+    memmove(&jobs[index], &jobs[index + 1], (num_jobs - index - 1) * sizeof(Job));
+    num_jobs--;
+}
+
+/*
+ * Finds a job from a "%n" or "n" spec, NULL picks the most recent job
+ */
+Job *find_job(const char *spec)
+{
+    if (spec == NULL) return (num_jobs > 0) ? &jobs[num_jobs - 1] : NULL;
+
+    if (spec[0] == '%') spec++;
+    int id = atoi(spec);
+    for (int i = 0; i < num_jobs; i++) if (jobs[i].id == id) return &jobs[i];
+    return NULL;
+}
+
+/*
+ * Collects state changes of a job's processes with waitpid(options).
+ * Without WNOHANG this blocks until one of them changes state.
+ */
+void update_job(Job *job, int options)
+{
+    int alive = 0;
+    int stopped = 0;
+
+    for (int i = 0; i < job->npids; i++)
+    {
+        if (job->pids[i] == 0) continue;
+
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(job->pids[i], &status, options | WUNTRACED | WCONTINUED, &usage);
+        if (pid == job->pids[i])
+        {
+            if (WIFSTOPPED(status)) stopped = 1;
+            else if (WIFCONTINUED(status)) job->state = JOB_RUNNING;
+            else
+            {
+                add_rusage(&job->usage, &usage);
+                int exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+                if (exit_status != 0) job->failed_status = exit_status;
+                if (i == job->npids - 1) job->status = exit_status;
+                job->pids[i] = 0;
+                continue;
+            }
+            // Only wait for one change when blocking, the caller loops
+            if (!(options & WNOHANG)) options |= WNOHANG;
+        }
+        else if (pid < 0 && errno == ECHILD)
+        {
+            // Already reaped elsewhere
+            job->pids[i] = 0;
+            continue;
+        }
+        alive++;
+    }
+
+    if (alive == 0) job->state = JOB_DONE;
+    else if (stopped) job->state = JOB_STOPPED;
+}
+
+/*
+ * Waits until a job finishes or stops. A stopped job that is not yet in the table (id 0) is added to it.
+ * Returns the job's status, following set -o pipefail.
+ */
+int wait_job(Job *job)
+{
+    do
+    {
+        update_job(job, 0);
+    } while (job->state == JOB_RUNNING);
+
+    if (job->state == JOB_STOPPED)
+    {
+        // Foreground jobs have no id until they first stop
+        if (job->id == 0) job = add_job(job);
+        if (job != NULL) fprintf(stderr, "\n[%d]+  Stopped\t\t%s\n", job->id, job->command);
+        return -1;
+    }
+
+    return opt_pipefail ? job->failed_status : job->status;
+}
+
+/*
+ * Waits for a foreground command's processes, moving them to the job table if they get stopped.
+ * command is the len bytes of job text. Takes ownership of pids. Returns the command's status.
+ */
+int wait_foreground(pid_t *pids, int npids, const char *command, size_t len)
+{
+    Job job;
+    job.id = 0;
+    job.pgid = 0;
+    job.pids = pids;
+    job.npids = npids;
+    job.status = 0;
+    job.failed_status = 0;
+    job.state = JOB_RUNNING;
+    job.command = strndup(command, len);
+    memset(&job.usage, 0, sizeof(job.usage));
+
+    int status = wait_job(&job);
+    add_rusage(&child_usage, &job.usage);
+
+    // Finished jobs never made it into the table
+    if (job.state == JOB_DONE)
+    {
+        free(job.pids);
+        free(job.command);
+    }
+    return status;
+}
+
+/*
+ * Reaps every job whose processes changed state since the last SIGCHLD, without blocking
+ */
+void reap_jobs()
+{
+    if (!sigchld_pending) return;
+    sigchld_pending = 0;
+
+    // Drain the self-pipe
+    char drain[64];
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0);
+
+    for (int i = 0; i < num_jobs; i++)
+    {
+        if (jobs[i].state != JOB_DONE) update_job(&jobs[i], WNOHANG);
+    }
+}
+
+/*
+ * Reports finished jobs and drops them from the table, done before each prompt
+ */
+void notify_jobs()
+{
+    reap_jobs();
+    for (int i = 0; i < num_jobs; i++)
+    {
+        if (jobs[i].state != JOB_DONE) continue;
+        if (interactive) fprintf(stderr, "[%d]+  Done\t\t%s\n", jobs[i].id, jobs[i].command);
+        remove_job(&jobs[i]);
+        i--;
+    }
+}
+
+/*
+ * Sends sig to every live process in a job
+ */
+void signal_job(Job *job, int sig)
+{
+    if (job->pgid > 0)
+    {
+        kill(-job->pgid, sig);
+        return;
+    }
+    for (int i = 0; i < job->npids; i++) if (job->pids[i] != 0) kill(job->pids[i], sig);
+}
+
+/*
+ * jobs: Lists the job table as [id] state command
+ */
+void wsh_jobs(char **args)
+{
+    (void)args;
+    reap_jobs();
+    for (int i = 0; i < num_jobs; i++)
+    {
+        const char *state = (jobs[i].state == JOB_RUNNING) ? "Running" : (jobs[i].state == JOB_STOPPED) ? "Stopped" : "Done";
+        printf("[%d]  %s\t\t%s\n", jobs[i].id, state, jobs[i].command);
+    }
+    return_var = 0;
+}
+
+/*
+ * wait [id]: Waits for the given job, or for every running job, return_var gets the job's status
+ */
+void wsh_wait(char **args)
+{
+    return_var = 0;
+
+    if (args[1] != NULL)
+    {
+        Job *job = find_job(args[1]);
+        if (job == NULL)
+        {
+            fprintf(stderr, "wait: %s: no such job\n", args[1]);
+            return_var = -1;
+            return;
+        }
+        if (job->state == JOB_STOPPED) return;
+
+        return_var = wait_job(job);
+        if (job->state == JOB_DONE) remove_job(job);
+        return;
+    }
+
+    for (int i = 0; i < num_jobs; i++)
+    {
+        if (jobs[i].state != JOB_RUNNING) continue;
+        return_var = wait_job(&jobs[i]);
+        if (jobs[i].state == JOB_DONE)
+        {
+            remove_job(&jobs[i]);
+            i--;
+        }
+    }
+}
+
+/*
+ * fg [id]: Continues a job in the foreground and waits for it
+ */
+void wsh_fg(char **args)
+{
+    Job *job = find_job(args[1]);
+    if (job == NULL)
+    {
+        fprintf(stderr, "fg: no such job\n");
+        return_var = -1;
+        return;
+    }
+
+    printf("%s\n", job->command);
+    fflush(stdout);
+
+    // Hand the terminal to the job's process group while it runs
+    int give_terminal = job_control && job->pgid > 0;
+    if (give_terminal) tcsetpgrp(STDIN_FILENO, job->pgid);
+
+    job->state = JOB_RUNNING;
+    signal_job(job, SIGCONT);
+    return_var = wait_job(job);
+    if (job->state == JOB_DONE) add_rusage(&child_usage, &job->usage);
+
+    if (give_terminal) tcsetpgrp(STDIN_FILENO, getpgrp());
+    if (job->state == JOB_DONE) remove_job(job);
+}
+
+/*
+ * bg [id]: Continues a stopped job in the background
+ */
+void wsh_bg(char **args)
+{
+    Job *job = find_job(args[1]);
+    if (job == NULL)
+    {
+        fprintf(stderr, "bg: no such job\n");
+        return_var = -1;
+        return;
+    }
+
+    job->state = JOB_RUNNING;
+    signal_job(job, SIGCONT);
+    printf("[%d]+ %s &\n", job->id, job->command);
+    return_var = 0;
+}
+
+/*
+ * Relative / full paths are run as given when executable, anything else is looked up in $PATH
+ */
+const char *resolve_command(const char *cmd)
+{
+    if (access(cmd, X_OK) == 0) return cmd;
+    return lookup_command(cmd);
+}
+
+/*
+ * Runs cmd1 | cmd2 | ... | cmdN with every stage running at once, each stage's stdout
+ * connected to the next stage's stdin. Built-in stages run in a forked copy of the shell.
+ * return_var is the last stage's status, or with set -o pipefail the last non-zero status.
+ * Returns -1 if the pipeline is malformed, otherwise 0.
+ */
+int execute_pipeline(Token *tokens, int background, const char *command, size_t command_len)
+{
+    // Job text is the line as typed, or the joined tokens when replayed from history
+    char *job_command = (command != NULL) ? strndup(command, command_len) : join_tokens(tokens);
+
+    // Split the tokens into stages at each |, each with its argv and redirection plan
+    int ntokens = 0;
+    while (tokens[ntokens].type != TOK_END) ntokens++;
+    char ***stages = arena_alloc(&line_arena, (ntokens + 1) * sizeof(char **));
+    Redirect **stage_redirs = arena_alloc(&line_arena, (ntokens + 1) * sizeof(Redirect *));
+    int *stage_nredirs = arena_alloc(&line_arena, (ntokens + 1) * sizeof(int));
+    int nstages = 0;
+    Token *tok = tokens;
+    while (1)
+    {
+        Token *stop = build_command(tok, &stages[nstages], &stage_redirs[nstages], &stage_nredirs[nstages]);
+        nstages++;
+        if (stop->type != TOK_PIPE) break;
+        tok = stop + 1;
+    }
+    for (int i = 0; i < nstages; i++)
+    {
+        if (stages[i][0] == NULL)
+        {
+            fprintf(stderr, "wsh: syntax error near '|'\n");
+            free(job_command);
+            return_var = -1;
+            return -1;
+        }
+    }
+
+    pid_t *pids = malloc(nstages * sizeof(pid_t));
+    if (pids == NULL)
+    {
+        perror("malloc");
+        free(job_command);
+        return_var = -1;
+        return -1;
+    }
+    // Background jobs get their own process group, led by the first stage
+    pid_t pgid = background ? 0 : -1;
+    int in_fd = -1;
+    for (int i = 0; i < nstages; i++)
+    {
+        char **stage = stages[i];
+        Redirect *redirs = stage_redirs[i];
+        int nredirs = stage_nredirs[i];
+        int pipe_fds[2] = { -1, -1 };
+
+        // Every stage but the last writes into a fresh pipe, close-on-exec so children only keep their own ends
+        if (i < nstages - 1 && pipe2(pipe_fds, O_CLOEXEC) < 0)
+        {
+            perror("pipe");
+            pipe_fds[0] = pipe_fds[1] = -1;
+        }
+
+        pids[i] = -1;
+        const Builtin *builtin = (stage[0] != NULL) ? find_builtin(stage[0]) : NULL;
+        if (builtin != NULL) pids[i] = spawn_builtin(builtin, stage, in_fd, pipe_fds[1], redirs, nredirs, pgid);
+        else if (stage[0] != NULL)
+        {
+            const char *full_path = resolve_command(stage[0]);
+            if (full_path != NULL) pids[i] = wsh_spawn(full_path, stage, in_fd, pipe_fds[1], redirs, nredirs, pgid);
+            else fprintf(stderr, "%s: command not found\n", stage[0]);
+        }
+        if (pids[i] < 0) pids[i] = 0;
+
+        // Later stages join the first stage's group, set from both sides to avoid racing the child
+        if (pids[i] > 0 && pgid == 0)
+        {
+            setpgid(pids[i], pids[i]);
+            pgid = pids[i];
+        }
+
+        // The shell keeps neither end once the stages have their copies
+        if (in_fd >= 0) close(in_fd);
+        if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+        in_fd = pipe_fds[0];
+    }
+
+    // Background pipelines go straight into the job table
+    if (background)
+    {
+        Job job;
+        job.pgid = (pgid > 0) ? pgid : 0;
+        job.pids = pids;
+        job.npids = nstages;
+        job.status = 0;
+        job.failed_status = 0;
+        job.state = JOB_RUNNING;
+        job.command = job_command;
+        memset(&job.usage, 0, sizeof(job.usage));
+
+        Job *added = add_job(&job);
+        if (added == NULL)
+        {
+            free(pids);
+            free(job_command);
+            return_var = -1;
+            return 0;
+        }
+        if (interactive) fprintf(stderr, "[%d] %d\n", added->id, (int)pids[nstages - 1]);
+        return_var = 0;
+        return 0;
+    }
+
+    // Wait for every stage, the pipeline's status comes from the last one (or the last failure with pipefail)
+    return_var = wait_foreground(pids, nstages, job_command, strlen(job_command));
+    free(job_command);
+    return 0;
+}
+
+/*
+ * Makes room for len more bytes and a NUL in a word being built in the line arena, moving it to
+ * a larger arena chunk if expansions have outgrown the room it started with
+ */
+void word_reserve(WordBuf *word, size_t len)
+{
+    if (word->len + len + 1 <= word->cap) return;
+
+    size_t cap = word->cap * 2;
+    while (cap < word->len + len + 1) cap *= 2;
+    char *data = arena_alloc(&line_arena, cap);
+    memcpy(data, word->data, word->len);
+    word->data = data;
+    word->cap = cap;
+}
+
+/*
+ * Appends len bytes of str to a word being built in the line arena
+ */
+void word_append(WordBuf *word, const char *str, size_t len)
+{
+    word_reserve(word, len);
+    memcpy(word->data + word->len, str, len);
+    word->len += len;
+}
+
+/*
+ * Finds the ) closing a $( whose body starts at s, skipping quoted text, escapes and nested parentheses.
+ * The text runs to end. Returns NULL if there is none.
+ */
+const char *find_subst_end(const char *s, const char *end)
+{
+    int depth = 1;
+    for (; s < end; s++)
+    {
+        if (*s == '\\' && s + 1 < end) s++;
+        else if (*s == '\'' || *s == '"')
+        {
+            const char *close = memchr(s + 1, *s, end - (s + 1));
+            if (close == NULL) return NULL;
+            s = close;
+        }
+        else if (*s == '(') depth++;
+        else if (*s == ')' && --depth == 0) return s;
+    }
+    return NULL;
+}
+
+/*
+ * Runs the command line cmd in a forked copy of the shell with its stdout on a pipe, and reads
+ * what it writes straight onto the end of word, dropping trailing newlines.
+ * The child goes through the normal lex and execute path, so nested $(...) work, and the
+ * return value becomes the command's status.
+ */
+void command_substitution(const char *cmd, WordBuf *word)
+{
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0)
+    {
+        perror("pipe");
+        return_var = -1;
+        return;
+    }
+
+    // Nothing the shell buffered may end up in the child's copy
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        zygote_detach();
+        close(pipe_fds[0]);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[1]);
+
+        // The substitution is part of the enclosing command, never a timelog record of its own
+        command_depth++;
+        execute_text(cmd, cmd + strlen(cmd), 1);
+        fflush(stdout);
+        _exit(return_var);
+    }
+    close(pipe_fds[1]);
+    if (pid < 0)
+    {
+        perror("fork");
+        close(pipe_fds[0]);
+        return_var = -1;
+        return;
+    }
+
+    // Read straight into the word, growing it as output arrives
+    size_t start = word->len;
+    size_t chunk = SUBST_CHUNK_SIZE;
+    while (1)
+    {
+        word_reserve(word, chunk);
+        ssize_t got = read(pipe_fds[0], word->data + word->len, word->cap - word->len - 1);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        word->len += got;
+        if (word->len + 1 == word->cap) chunk *= 2;
+    }
+    close(pipe_fds[0]);
+
+    while (word->len > start && word->data[word->len - 1] == '\n') word->len--;
+
+    pid_t *pids = malloc(sizeof(pid_t));
+    if (pids == NULL)
+    {
+        perror("malloc");
+        waitpid(pid, NULL, 0);
+        return_var = -1;
+        return;
+    }
+    pids[0] = pid;
+    return_var = wait_foreground(pids, 1, cmd, strlen(cmd));
+}
+
+/*
+ * Finds the )) that ends the expression of a $((, with s just past the (( and the text running to end.
+ * Returns NULL if the parentheses close some other way, which makes the text a $( whose command starts with (.
+ */
+const char *find_arith_end(const char *s, const char *end)
+{
+    int depth = 0;
+    for (; s < end; s++)
+    {
+        if (*s == '(') depth++;
+        else if (*s == ')')
+        {
+            if (depth == 0) return (s + 1 < end && s[1] == ')') ? s : NULL;
+            depth--;
+        }
+    }
+    return NULL;
+}
+
+void arith_skip_blanks(ArithCompiler *c)
+{
+    while (isspace((unsigned char)*c->pos)) c->pos++;
+}
+
+/*
+ * Appends an instruction, returns its index so jumps can be patched once their target is known
+ */
+uint32_t arith_emit(ArithCompiler *c, uint32_t op, int64_t value, const char *name)
+{
+    // Every instruction consumes at least one character, so this only trips on malformed input
+    if (c->count == c->cap)
+    {
+        c->failed = 1;
+        return 0;
+    }
+
+    ArithOp *instr = &c->code[c->count];
+    instr->op = op;
+    instr->target = 0;
+    instr->value = value;
+    instr->name = name;
+    return c->count++;
+}
+
+/*
+ * Reads a variable name written bare, as $NAME or as ${NAME}.
+ * Returns it in the line arena, or NULL without moving if there is none.
+ */
+const char *arith_name(ArithCompiler *c)
+{
+    const char *s = c->pos;
+    int braced = 0;
+    if (*s == '$')
+    {
+        s++;
+        braced = (*s == '{');
+        if (braced) s++;
+    }
+    if (!isalpha((unsigned char)*s) && *s != '_') return NULL;
+
+    const char *start = s;
+    while (isalnum((unsigned char)*s) || *s == '_') s++;
+    const char *end = s;
+    if (braced && *s++ != '}') return NULL;
+
+    c->pos = s;
+    return arena_strndup(&line_arena, start, end - start);
+}
+
+/*
+ * Matches an assignment operator at s. Returns the operator it combines the old value with,
+ * ARITH_NUM for a plain =, or -1 if there is none.
+ */
+int arith_assign_op(const char *s, int *len)
+{
+    static const struct { const char *text; uint32_t op; } ops[] = {
+        { "<<=", ARITH_SHL }, { ">>=", ARITH_SHR }, { "*=", ARITH_MUL }, { "/=", ARITH_DIV }, { "%=", ARITH_MOD },
+        { "+=", ARITH_ADD }, { "-=", ARITH_SUB }, { "&=", ARITH_BITAND }, { "^=", ARITH_BITXOR }, { "|=", ARITH_BITOR }
+    };
+
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        size_t n = strlen(ops[i].text);
+        if (strncmp(s, ops[i].text, n) == 0)
+        {
+            *len = n;
+            return ops[i].op;
+        }
+    }
+    if (s[0] == '=' && s[1] != '=')
+    {
+        *len = 1;
+        return ARITH_NUM;
+    }
+    return -1;
+}
+
+/*
+ * Matches a binary operator at s, longest first, and gives its precedence, higher binding tighter.
+ * Returns -1 if there is none.
+ */
+int arith_binary_op(const char *s, int *len, int *prec)
+{
+    static const struct { const char *text; uint32_t op; int prec; } ops[] = {
+        { "||", ARITH_OR, 1 }, { "&&", ARITH_AND, 2 }, { "==", ARITH_EQ, 6 }, { "!=", ARITH_NE, 6 },
+        { "<=", ARITH_LE, 7 }, { ">=", ARITH_GE, 7 }, { "<<", ARITH_SHL, 8 }, { ">>", ARITH_SHR, 8 },
+        { "|", ARITH_BITOR, 3 }, { "^", ARITH_BITXOR, 4 }, { "&", ARITH_BITAND, 5 }, { "<", ARITH_LT, 7 },
+        { ">", ARITH_GT, 7 }, { "+", ARITH_ADD, 9 }, { "-", ARITH_SUB, 9 }, { "*", ARITH_MUL, 10 },
+        { "/", ARITH_DIV, 10 }, { "%", ARITH_MOD, 10 }
+    };
+
+    // ** comes before *
+    if (s[0] == '*' && s[1] == '*')
+    {
+        *len = 2;
+        *prec = 11;
+        return ARITH_POW;
+    }
+
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+        size_t n = strlen(ops[i].text);
+        if (strncmp(s, ops[i].text, n) != 0) continue;
+
+        // x += 1 and friends are assignments
+        if (s[n] == '=' && ops[i].prec != 6 && ops[i].prec != 7) return -1;
+        *len = n;
+        *prec = ops[i].prec;
+        return ops[i].op;
+    }
+    return -1;
+}
+
+/*
+ * expr: assignments separated by commas, worth the last one
+ */
+void arith_expr(ArithCompiler *c)
+{
+    arith_assign(c);
+    arith_skip_blanks(c);
+    while (!c->failed && *c->pos == ',')
+    {
+        c->pos++;
+        arith_emit(c, ARITH_POP, 0, NULL);
+        arith_assign(c);
+        arith_skip_blanks(c);
+    }
+}
+
+/*
+ * assign: NAME = assign or NAME op= assign, right to left, otherwise a conditional
+ */
+void arith_assign(ArithCompiler *c)
+{
+    arith_skip_blanks(c);
+    const char *start = c->pos;
+    const char *name = arith_name(c);
+    if (name != NULL)
+    {
+        arith_skip_blanks(c);
+        int len;
+        int op = arith_assign_op(c->pos, &len);
+        if (op >= 0)
+        {
+            c->pos += len;
+            arith_assign(c);
+            arith_emit(c, ARITH_ASSIGN, op, name);
+            return;
+        }
+        c->pos = start;
+    }
+    arith_ternary(c);
+}
+
+/*
+ * conditional: binary ? expr : assign, only one branch runs
+ */
+void arith_ternary(ArithCompiler *c)
+{
+    arith_binary(c, 1);
+    arith_skip_blanks(c);
+    if (c->failed || *c->pos != '?') return;
+    c->pos++;
+
+    uint32_t skip_then = arith_emit(c, ARITH_JUMP_IF_ZERO, 0, NULL);
+    arith_expr(c);
+    if (*c->pos != ':')
+    {
+        c->failed = 1;
+        return;
+    }
+    c->pos++;
+
+    uint32_t skip_else = arith_emit(c, ARITH_JUMP, 0, NULL);
+    c->code[skip_then].target = c->count;
+    arith_assign(c);
+    c->code[skip_else].target = c->count;
+}
+
+/*
+ * Binary operators by precedence climbing: operands bind to operators of at least min_prec, left to right.
+ * && and || skip their right side once the left decides the result.
+ */
+void arith_binary(ArithCompiler *c, int min_prec)
+{
+    arith_unary(c);
+    while (!c->failed)
+    {
+        arith_skip_blanks(c);
+        int len, prec;
+        int op = arith_binary_op(c->pos, &len, &prec);
+        if (op < 0 || prec < min_prec) return;
+        c->pos += len;
+
+        if (op == ARITH_AND || op == ARITH_OR)
+        {
+            uint32_t skip = arith_emit(c, op, 0, NULL);
+            arith_binary(c, prec + 1);
+            arith_emit(c, ARITH_BOOL, 0, NULL);
+            c->code[skip].target = c->count;
+        }
+        else
+        {
+            // ** groups right to left
+            arith_binary(c, (op == ARITH_POW) ? prec : prec + 1);
+            arith_emit(c, op, 0, NULL);
+        }
+    }
+}
+
+/*
+ * unary: ++NAME, --NAME, or + - ! ~ applied to a unary, otherwise a primary
+ */
+void arith_unary(ArithCompiler *c)
+{
+    arith_skip_blanks(c);
+    char ch = *c->pos;
+
+    if ((ch == '+' || ch == '-') && c->pos[1] == ch)
+    {
+        const char *start = c->pos;
+        c->pos += 2;
+        arith_skip_blanks(c);
+        const char *name = arith_name(c);
+        if (name != NULL)
+        {
+            arith_emit(c, ARITH_INCR, (ch == '+') ? 1 : -1, name);
+            return;
+        }
+
+        // Without a name after it, -- is two minus signs
+        c->pos = start;
+    }
+
+    if (ch == '+' || ch == '-' || ch == '!' || ch == '~')
+    {
+        c->pos++;
+        arith_unary(c);
+        if (ch == '-') arith_emit(c, ARITH_NEG, 0, NULL);
+        else if (ch == '!') arith_emit(c, ARITH_NOT, 0, NULL);
+        else if (ch == '~') arith_emit(c, ARITH_BITNOT, 0, NULL);
+        return;
+    }
+
+    arith_primary(c);
+}
+
+/*
+ * primary: a number in decimal, 0x hex or 0 octal, a variable, NAME++, NAME-- or ( expr )
+ */
+void arith_primary(ArithCompiler *c)
+{
+    arith_skip_blanks(c);
+
+    if (*c->pos == '(')
+    {
+        c->pos++;
+        arith_expr(c);
+        if (*c->pos != ')')
+        {
+            c->failed = 1;
+            return;
+        }
+        c->pos++;
+        return;
+    }
+
+    if (isdigit((unsigned char)*c->pos))
+    {
+        // Numbers past INT64_MAX wrap around, as they do in bash
+        char *end;
+        errno = 0;
+        unsigned long long value = strtoull(c->pos, &end, 0);
+        if (errno != 0 || isalnum((unsigned char)*end) || *end == '_')
+        {
+            c->failed = 1;
+            return;
+        }
+        c->pos = end;
+        arith_emit(c, ARITH_NUM, (int64_t)value, NULL);
+        return;
+    }
+
+    const char *name = arith_name(c);
+    if (name == NULL)
+    {
+        c->failed = 1;
+        return;
+    }
+
+    arith_skip_blanks(c);
+    char ch = *c->pos;
+    if ((ch == '+' || ch == '-') && c->pos[1] == ch)
+    {
+        c->pos += 2;
+        uint32_t incr = arith_emit(c, ARITH_INCR, (ch == '+') ? 1 : -1, name);
+        c->code[incr].target = 1;
+        return;
+    }
+    arith_emit(c, ARITH_VAR, 0, name);
+}
+
+/*
+ * Compiles an arithmetic expression into stack code in the line arena. An empty expression is 0.
+ * Returns the code, or NULL after reporting a syntax error.
+ */
+ArithOp *arith_compile(const char *expr, uint32_t *count)
+{
+    ArithCompiler c;
+    c.pos = expr;
+    c.cap = strlen(expr) + 1;
+    c.code = arena_alloc(&line_arena, c.cap * sizeof(ArithOp));
+    c.count = 0;
+    c.failed = 0;
+
+    arith_skip_blanks(&c);
+    if (*c.pos == '\0') arith_emit(&c, ARITH_NUM, 0, NULL);
+    else arith_expr(&c);
+    arith_skip_blanks(&c);
+
+    if (c.failed || *c.pos != '\0')
+    {
+        fprintf(stderr, "wsh: %s: syntax error in expression\n", expr);
+        return NULL;
+    }
+    *count = c.count;
+    return c.code;
+}
+
+/*
+ * Reads a variable as an integer, environment first, then locals. Unset and empty variables are 0.
+ * Returns -1 after reporting a value that is not an integer.
+ */
+int arith_value(const char *name, int64_t *value)
+{
+    const char *text = getenv(name);
+    if (text == NULL) text = get_local(name);
+    *value = 0;
+    if (text == NULL) return 0;
+
+    while (isspace((unsigned char)*text)) text++;
+    if (*text == '\0') return 0;
+
+    char *end;
+    errno = 0;
+    long long parsed = strtoll(text, &end, 0);
+    while (isspace((unsigned char)*end)) end++;
+    if (errno != 0 || *end != '\0')
+    {
+        fprintf(stderr, "wsh: %s: %s: not an integer\n", name, text);
+        return -1;
+    }
+    *value = parsed;
+    return 0;
+}
+
+/*
+ * Assigns an integer to a variable. Exported variables stay exported, anything else becomes a local.
+ * Returns 0, or -1 on failure.
+ */
+int arith_store(const char *name, int64_t value)
+{
+    char text[24];
+    snprintf(text, sizeof(text), "%lld", (long long)value);
+    if (getenv(name) != NULL)
+    {
+        if (setenv(name, text, 1) < 0)
+        {
+            perror("setenv");
+            return -1;
+        }
+        return 0;
+    }
+    return set_local(name, text);
+}
+
+/*
+ * Applies a binary operator. Overflow wraps around instead of being undefined, b is never 0
+ * for / and % and never negative for **.
+ */
+int64_t arith_apply(uint32_t op, int64_t a, int64_t b)
+{
+    uint64_t ua = a;
+    uint64_t ub = b;
+    switch (op)
+    {
+        case ARITH_POW:
+        {
+            // Square and multiply
+            uint64_t result = 1;
+            for (; ub != 0; ub >>= 1, ua *= ua)
+            {
+                if (ub & 1) result *= ua;
+            }
+            return (int64_t)result;
+        }
+        case ARITH_MUL: return (int64_t)(ua * ub);
+        case ARITH_DIV: return (b == -1) ? (int64_t)(0 - ua) : a / b;
+        case ARITH_MOD: return (b == -1) ? 0 : a % b;
+        case ARITH_ADD: return (int64_t)(ua + ub);
+        case ARITH_SUB: return (int64_t)(ua - ub);
+        case ARITH_SHL: return (int64_t)(ua << (ub & 63));
+        case ARITH_SHR: return a >> (ub & 63);
+        case ARITH_LT: return a < b;
+        case ARITH_LE: return a <= b;
+        case ARITH_GT: return a > b;
+        case ARITH_GE: return a >= b;
+        case ARITH_EQ: return a == b;
+        case ARITH_NE: return a != b;
+        case ARITH_BITAND: return a & b;
+        case ARITH_BITXOR: return a ^ b;
+        case ARITH_BITOR: return a | b;
+    }
+    return 0;
+}
+
+/*
+ * Runs compiled arithmetic code, assigning variables as it goes.
+ * Returns 0 with the value in *result, or -1 after reporting an error.
+ */
+int arith_run(const ArithOp *code, uint32_t count, int64_t *result)
+{
+    // Every instruction pushes at most one value
+    int64_t *stack = arena_alloc(&line_arena, (count + 1) * sizeof(int64_t));
+    uint32_t sp = 0;
+
+    uint32_t pc = 0;
+    while (pc < count)
+    {
+        const ArithOp *instr = &code[pc++];
+        switch (instr->op)
+        {
+            case ARITH_NUM:
+                stack[sp++] = instr->value;
+                break;
+            case ARITH_VAR:
+                if (arith_value(instr->name, &stack[sp++]) < 0) return -1;
+                break;
+            case ARITH_ASSIGN:
+            {
+                int64_t value = stack[sp - 1];
+                if (instr->value != ARITH_NUM)
+                {
+                    int64_t old;
+                    if (arith_value(instr->name, &old) < 0) return -1;
+                    if ((instr->value == ARITH_DIV || instr->value == ARITH_MOD) && value == 0)
+                    {
+                        fprintf(stderr, "wsh: division by zero\n");
+                        return -1;
+                    }
+                    value = arith_apply(instr->value, old, value);
+                }
+                if (arith_store(instr->name, value) < 0) return -1;
+                stack[sp - 1] = value;
+                break;
+            }
+            case ARITH_INCR:
+            {
+                int64_t old;
+                if (arith_value(instr->name, &old) < 0) return -1;
+                int64_t value = (int64_t)((uint64_t)old + (uint64_t)instr->value);
+                if (arith_store(instr->name, value) < 0) return -1;
+                stack[sp++] = instr->target ? old : value;
+                break;
+            }
+            case ARITH_NEG:
+                stack[sp - 1] = (int64_t)(0 - (uint64_t)stack[sp - 1]);
+                break;
+            case ARITH_NOT:
+                stack[sp - 1] = !stack[sp - 1];
+                break;
+            case ARITH_BITNOT:
+                stack[sp - 1] = ~stack[sp - 1];
+                break;
+            case ARITH_BOOL:
+                stack[sp - 1] = (stack[sp - 1] != 0);
+                break;
+            case ARITH_AND:
+                // A 0 on top is already the result
+                if (stack[sp - 1] == 0) pc = instr->target;
+                else sp--;
+                break;
+            case ARITH_OR:
+                if (stack[sp - 1] != 0)
+                {
+                    stack[sp - 1] = 1;
+                    pc = instr->target;
+                }
+                else sp--;
+                break;
+            case ARITH_JUMP_IF_ZERO:
+                if (stack[--sp] == 0) pc = instr->target;
+                break;
+            case ARITH_JUMP:
+                pc = instr->target;
+                break;
+            case ARITH_POP:
+                sp--;
+                break;
+            default:
+            {
+                int64_t b = stack[--sp];
+                if ((instr->op == ARITH_DIV || instr->op == ARITH_MOD) && b == 0)
+                {
+                    fprintf(stderr, "wsh: division by zero\n");
+                    return -1;
+                }
+                if (instr->op == ARITH_POW && b < 0)
+                {
+                    fprintf(stderr, "wsh: exponent less than 0\n");
+                    return -1;
+                }
+                stack[sp - 1] = arith_apply(instr->op, stack[sp - 1], b);
+                break;
+            }
+        }
+    }
+
+    *result = stack[sp - 1];
+    return 0;
+}
+
+/*
+ * Compiles and runs an arithmetic expression. Returns 0 with its value in *result, or -1 after reporting an error.
+ */
+int arith_eval(const char *expr, int64_t *result)
+{
+    uint32_t count;
+    ArithOp *code = arith_compile(expr, &count);
+    if (code == NULL) return -1;
+    return arith_run(code, count, result);
+}
+
+/*
+ * let EXPR...: Evaluates each arithmetic expression in turn. As in bash, the status is 0 if the last
+ * one is not 0, and 1 if it is.
+ */
+void wsh_let(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "let: usage: let EXPR...\n");
+        return_var = -1;
+        return;
+    }
+
+    int64_t value = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (arith_eval(args[i], &value) < 0)
+        {
+            return_var = -1;
+            return;
+        }
+    }
+    return_var = (value != 0) ? 0 : 1;
+}
+
+/*
+ * Reports a syntax error found while lexing or compiling, unless a script is being compiled ahead of running
+ */
+void syntax_error(const char *format, ...)
+{
+    if (syntax_errors_quiet) return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+/*
+ * While compiling, moves the literal text lexed since the last expansion into a segment
+ */
+void word_flush_literal(WordBuf *word)
+{
+    if (word->len > word->lit_start) ir_add_segment(compile_target, SEG_LIT, word->data + word->lit_start, word->len - word->lit_start, word->in_quotes);
+    word->lit_start = word->len;
+}
+
+/*
+ * Expands the $VAR, ${VAR}, $(cmd) or $((expr)) at *p, just past the $, onto the word and moves *p past it.
+ * The text runs to end.
+ * Environment variables come first, then locals, and unset variables expand to nothing.
+ * A $ that does not start a reference is kept as is. While compiling, the reference is
+ * recorded as a segment instead.
+ * Returns -1 after reporting an unterminated $( or a failed arithmetic expansion.
+ */
+int expand_var(const char **p, const char *end, WordBuf *word)
+{
+    const char *start = *p;
+
+    // $(( is arithmetic when its parentheses end in ))
+    const char *arith_end = (end - start >= 2 && start[0] == '(' && start[1] == '(') ? find_arith_end(start + 2, end) : NULL;
+    if (arith_end != NULL)
+    {
+        const char *expr = start + 2;
+        *p = arith_end + 2;
+        if (compile_target != NULL)
+        {
+            word_flush_literal(word);
+            ir_add_segment(compile_target, SEG_ARITH, expr, arith_end - expr, word->in_quotes);
+            return 0;
+        }
+
+        int64_t value;
+        if (arith_eval(arena_strndup(&line_arena, expr, arith_end - expr), &value) < 0) return -1;
+        char text[24];
+        word_append(word, text, snprintf(text, sizeof(text), "%lld", (long long)value));
+        return 0;
+    }
+
+    if (start < end && *start == '(')
+    {
+        const char *close = find_subst_end(start + 1, end);
+        if (close == NULL)
+        {
+            syntax_error("wsh: unterminated $(\n");
+            return -1;
+        }
+        if (compile_target != NULL)
+        {
+            word_flush_literal(word);
+            ir_add_segment(compile_target, SEG_CMDSUB, start + 1, close - (start + 1), word->in_quotes);
+        }
+        else command_substitution(arena_strndup(&line_arena, start + 1, close - (start + 1)), word);
+        *p = close + 1;
+        return 0;
+    }
+
+    int braced = (start < end && *start == '{');
+    if (braced) start++;
+
+    const char *name_end = start;
+    while (name_end < end && (isalnum((unsigned char)*name_end) || *name_end == '_')) name_end++;
+    if (name_end == start || (braced && (name_end == end || *name_end != '}')))
+    {
+        word_append(word, "$", 1);
+        return 0;
+    }
+
+    *p = braced ? name_end + 1 : name_end;
+
+    // Compiled blocks look the variable up each time they run
+    if (compile_target != NULL)
+    {
+        word_flush_literal(word);
+        ir_add_segment(compile_target, SEG_VAR, start, name_end - start, word->in_quotes);
+        return 0;
+    }
+
+    char *name = arena_strndup(&line_arena, start, name_end - start);
+    const char *value = getenv(name);
+    if (value == NULL) value = get_local(name);
+    if (value != NULL) word_append(word, value, strlen(value));
+
+    return 0;
+}
+
+// Characters that end a plain run in a word, outside quotes and inside double quotes
+const unsigned char word_specials[256] =
+{
+    [' '] = 1, ['\t'] = 1, ['|'] = 1, ['&'] = 1, ['<'] = 1, ['>'] = 1, [';'] = 1, ['\''] = 1, ['"'] = 1, ['\\'] = 1, ['$'] = 1
+};
+const unsigned char quoted_specials[256] = { ['"'] = 1, ['\\'] = 1, ['$'] = 1 };
+
+/*
+ * strcspn for text that runs to end rather than to a NUL, with the rejected characters marked in stop
+ */
+size_t span_until(const char *s, const char *end, const unsigned char *stop)
+{
+    const char *p = s;
+    while (p < end && !stop[(unsigned char)*p]) p++;
+    return p - s;
+}
+
+/*
+ * Lexes one word at *p, ending at a blank, an unquoted operator or end, and moves *p past it.
+ * Quotes are removed, a backslash escapes the next character and variables and $(...)
+ * expand inline, except inside single quotes.
+ * *quoted is set if the word had any quoting, so an empty "" still counts as a word.
+ * Returns the word in the line arena, or NULL after reporting an unterminated quote.
+ */
+char *lex_word(const char **p, const char *end, int *quoted)
+{
+    const char *s = *p;
+
+    // Most words are one plain run, anything longer grows through word_append
+    WordBuf word;
+    word.cap = span_until(s, end, word_specials) + 16;
+    word.data = arena_alloc(&line_arena, word.cap);
+    word.len = 0;
+    word.lit_start = 0;
+    word.in_quotes = 0;
+
+    while (s < end)
+    {
+        // Plain characters are copied a run at a time
+        size_t run = span_until(s, end, word_specials);
+        word_append(&word, s, run);
+        s += run;
+        if (s == end) break;
+
+        char c = *s;
+        if (c == ' ' || c == '\t' || c == '|' || c == '&' || c == '<' || c == '>' || c == ';') break;
+
+        if (c == '\\')
+        {
+            s++;
+            if (s < end) word_append(&word, s++, 1);
+        }
+        else if (c == '$')
+        {
+            s++;
+            if (expand_var(&s, end, &word) < 0) return NULL;
+        }
+        // Single quotes keep everything up to the closing quote
+        else if (c == '\'')
+        {
+            *quoted = 1;
+            const char *close = memchr(s + 1, '\'', end - (s + 1));
+            if (close == NULL)
+            {
+                syntax_error("wsh: unterminated quote\n");
+                return NULL;
+            }
+            word_append(&word, s + 1, close - (s + 1));
+            s = close + 1;
+        }
+        // Double quotes still expand variables, and \ only escapes " \ and $
+        else
+        {
+            *quoted = 1;
+            word.in_quotes = 1;
+            s++;
+            while (s == end || *s != '"')
+            {
+                if (s == end)
+                {
+                    syntax_error("wsh: unterminated quote\n");
+                    return NULL;
+                }
+
+                run = span_until(s, end, quoted_specials);
+                word_append(&word, s, run);
+                s += run;
+                if (s == end) continue;
+
+                if (*s == '\\')
+                {
+                    if (s + 1 < end && (s[1] == '"' || s[1] == '\\' || s[1] == '$')) s++;
+                    word_append(&word, s++, 1);
+                }
+                else if (*s == '$')
+                {
+                    s++;
+                    if (expand_var(&s, end, &word) < 0) return NULL;
+                }
+            }
+            s++;
+            word.in_quotes = 0;
+        }
+    }
+
+    if (compile_target != NULL) word_flush_literal(&word);
+    word.data[word.len] = '\0';
+    *p = s;
+    return word.data;
+}
+
+/*
+ * While compiling, keeps a word that is a single piece of literal text as a string in the pool instead of
+ * a segment: nsegs becomes 0 and first_seg holds the string's offset
+ */
+void compile_literal_word(Token *tok)
+{
+    Program *prog = compile_target;
+    uint32_t nsegs = prog->nsegs - tok->first_seg;
+    if (nsegs == 0) tok->first_seg = ir_add_string(prog, "", 0);
+    else if (nsegs == 1 && prog->segs[tok->first_seg].type == SEG_LIT) tok->first_seg = prog->segs[--prog->nsegs].offset;
+    else
+    {
+        tok->nsegs = nsegs;
+        return;
+    }
+    tok->nsegs = 0;
+}
+
+/*
+ * Splits one command, up to a ; or end, into typed tokens in a single pass: words,
+ * redirections with their fd, flags and target already parsed, |, and a trailing &. Moves *p past
+ * the command and its ;. Variables are expanded into the line arena as words are lexed, and a word
+ * that expands to nothing without quotes is dropped. While compiling, words are recorded as segments.
+ * Returns an array ended by TOK_END, or NULL after reporting a syntax error.
+ */
+Token *lex_command(const char **pos, const char *end)
+{
+    const char *p = *pos;
+    int cap = 16;
+    int ntokens = 0;
+    Token *tokens = arena_alloc(&line_arena, cap * sizeof(Token));
+
+    while (1)
+    {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+        if (ntokens + 1 >= cap)
+        {
+            Token *grown = arena_alloc(&line_arena, 2 * cap * sizeof(Token));
+            memcpy(grown, tokens, ntokens * sizeof(Token));
+            tokens = grown;
+            cap *= 2;
+        }
+        Token *tok = &tokens[ntokens];
+
+        if (p == end || *p == ';')
+        {
+            if (p < end) p++;
+            tok->type = TOK_END;
+            tok->text = NULL;
+            break;
+        }
+        tok->quoted = 0;
+        tok->first_seg = 0;
+        tok->nsegs = 0;
+
+        // A single digit right before < or > names the descriptor
+        const char *start = p;
+        int fd = -1;
+        if (end - p >= 2 && isdigit((unsigned char)p[0]) && (p[1] == '<' || p[1] == '>')) fd = *p++ - '0';
+
+        if (*p == '|')
+        {
+            tok->type = TOK_PIPE;
+            tok->text = "|";
+            p++;
+        }
+        else if (*p == '&' && (p + 1 == end || p[1] != '>'))
+        {
+            tok->type = TOK_AMP;
+            tok->text = "&";
+            p++;
+        }
+        // <, >, >>, &> and &>>
+        else if (*p == '<' || *p == '>' || *p == '&')
+        {
+            Redirect *redir = &tok->redir;
+            redir->both = 0;
+            if (*p == '<')
+            {
+                redir->fd = STDIN_FILENO;
+                redir->flags = O_RDONLY;
+                p++;
+            }
+            else
+            {
+                if (*p == '&')
+                {
+                    redir->both = 1;
+                    p++;
+                }
+                redir->fd = STDOUT_FILENO;
+                p++;
+                if (p < end && *p == '>')
+                {
+                    redir->flags = O_WRONLY | O_CREAT | O_APPEND;
+                    p++;
+                }
+                else redir->flags = O_WRONLY | O_CREAT | O_TRUNC;
+            }
+            if (fd >= 0) redir->fd = fd;
+
+            tok->type = TOK_REDIR;
+            tok->text = arena_strndup(&line_arena, start, p - start);
+
+            // The target is the next word, with or without a space before it
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            if (p == end || *p == '|' || *p == '&' || *p == '<' || *p == '>' || *p == ';')
+            {
+                syntax_error("wsh: missing redirection target\n");
+                return NULL;
+            }
+            if (compile_target != NULL) tok->first_seg = compile_target->nsegs;
+            redir->filename = lex_word(&p, end, &tok->quoted);
+            if (redir->filename == NULL) return NULL;
+            if (compile_target != NULL) tok->nsegs = compile_target->nsegs - tok->first_seg;
+        }
+        else
+        {
+            tok->type = TOK_WORD;
+            if (compile_target != NULL) tok->first_seg = compile_target->nsegs;
+            tok->text = lex_word(&p, end, &tok->quoted);
+            if (tok->text == NULL) return NULL;
+            if (compile_target != NULL) compile_literal_word(tok);
+            else if (tok->text[0] == '\0' && !tok->quoted) continue;
+        }
+        ntokens++;
+    }
+
+    // & may only end a command
+    for (int i = 0; i < ntokens - 1; i++)
+    {
+        if (tokens[i].type == TOK_AMP)
+        {
+            syntax_error("wsh: syntax error near '&'\n");
+            return NULL;
+        }
+    }
+
+    *pos = p;
+    return tokens;
+}
+
+/*
+ * Wraps already expanded words as tokens, for built-ins that run the rest of their arguments as a command
+ */
+Token *words_to_tokens(char **words)
+{
+    int nwords = 0;
+    while (words[nwords] != NULL) nwords++;
+
+    Token *tokens = arena_alloc(&line_arena, (nwords + 1) * sizeof(Token));
+    for (int i = 0; i < nwords; i++)
+    {
+        tokens[i].type = TOK_WORD;
+        tokens[i].text = words[i];
+    }
+    tokens[nwords].type = TOK_END;
+    tokens[nwords].text = NULL;
+    return tokens;
+}
+
+/*
+ * Collects one simple command's words into argv and its redirections into a plan, both in the line
+ * arena, stopping at a | or the end of the tokens. Returns the token it stopped at.
+ */
+Token *build_command(Token *tokens, char ***argv, Redirect **redirs, int *nredirs)
+{
+    int count = 0;
+    while (tokens[count].type != TOK_END && tokens[count].type != TOK_PIPE) count++;
+
+    char **args = arena_alloc(&line_arena, (count + 1) * sizeof(char *));
+    Redirect *plan = arena_alloc(&line_arena, (count + 1) * sizeof(Redirect));
+    int nargs = 0;
+    int nplan = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (tokens[i].type == TOK_WORD) args[nargs++] = tokens[i].text;
+        else if (tokens[i].type == TOK_REDIR) plan[nplan++] = tokens[i].redir;
+    }
+    args[nargs] = NULL;
+
+    *argv = args;
+    *redirs = plan;
+    *nredirs = nplan;
+    return &tokens[count];
+}
+
+/*
+ * Makes room for one more element in a growable array, doubling its capacity.
+ * Exits if memory runs out, like the line arena.
+ */
+void *grow_array(void *array, uint32_t count, uint32_t *capacity, size_t elem_size)
+{
+    if (count < *capacity) return array;
+
+    uint32_t new_capacity = (*capacity > 0) ? *capacity * 2 : 16;
+    void *grown = realloc(array, new_capacity * elem_size);
+    if (grown == NULL)
+    {
+        perror("realloc");
+        exit(-1);
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+/*
+ * Copies len bytes of str into the program's string pool as a NUL terminated string, returns its offset
+ */
+uint32_t ir_add_string(Program *prog, const char *str, size_t len)
+{
+    if (prog->pool_len + len + 1 > prog->pool_cap)
+    {
+        uint32_t new_capacity = (prog->pool_cap > 0) ? prog->pool_cap : 256;
+        while (prog->pool_len + len + 1 > new_capacity) new_capacity *= 2;
+        char *grown = realloc(prog->pool, new_capacity);
+        if (grown == NULL)
+        {
+            perror("realloc");
+            exit(-1);
+        }
+        prog->pool = grown;
+        prog->pool_cap = new_capacity;
+    }
+
+    uint32_t offset = prog->pool_len;
+    memcpy(prog->pool + offset, str, len);
+    prog->pool[offset + len] = '\0';
+    prog->pool_len += len + 1;
+    return offset;
+}
+
+/*
+ * Adds a word segment: literal text, a variable name or the text of a $(...).
+ * Variables that already exist have their slot looked up now, so running the block starts with it cached.
+ */
+void ir_add_segment(Program *prog, uint32_t type, const char *text, size_t len, int quoted)
+{
+    uint32_t slots_cap = prog->segs_cap;
+    prog->segs = grow_array(prog->segs, prog->nsegs, &prog->segs_cap, sizeof(Segment));
+    prog->slots = grow_array(prog->slots, prog->nsegs, &slots_cap, sizeof(int32_t));
+    uint32_t offset = ir_add_string(prog, text, len);
+
+    Segment *seg = &prog->segs[prog->nsegs];
+    seg->type = type;
+    seg->offset = offset;
+    seg->len = len;
+    seg->hash = 0;
+    seg->quoted = quoted;
+    prog->slots[prog->nsegs++] = 0;
+    if (type == SEG_VAR)
+    {
+        seg->hash = hash_string(prog->pool + offset);
+        int slot = find_var_slot(prog->pool + offset, seg->hash);
+        if (slot >= 0) prog->slots[prog->nsegs - 1] = var_index[slot] + 1;
+    }
+}
+
+/*
+ * Appends an instruction, returns its index so jumps can be patched once their target is known
+ */
+uint32_t ir_emit(Program *prog, uint32_t op, uint32_t a, uint32_t b, uint32_t c)
+{
+    prog->code = grow_array(prog->code, prog->ncode, &prog->code_cap, sizeof(Instr));
+    Instr *instr = &prog->code[prog->ncode];
+    instr->op = op;
+    instr->a = a;
+    instr->b = b;
+    instr->c = c;
+    return prog->ncode++;
+}
+
+/*
+ * Copies lexed tokens into the program, returns the index of the first
+ */
+uint32_t ir_add_tokens(Program *prog, const Token *tokens, int count)
+{
+    uint32_t first = prog->ntokens;
+    for (int i = 0; i < count; i++)
+    {
+        prog->tokens = grow_array(prog->tokens, prog->ntokens, &prog->tokens_cap, sizeof(IrToken));
+        IrToken *tok = &prog->tokens[prog->ntokens++];
+        tok->type = tokens[i].type;
+        tok->quoted = tokens[i].quoted;
+        tok->first_seg = tokens[i].first_seg;
+        tok->nsegs = tokens[i].nsegs;
+        tok->fd = tokens[i].redir.fd;
+        tok->both = tokens[i].redir.both;
+        tok->flags = tokens[i].redir.flags;
+        tok->text = 0;
+        if (tokens[i].type != TOK_WORD) tok->text = ir_add_string(prog, tokens[i].text, strlen(tokens[i].text));
+        else if (tokens[i].nsegs == 0)
+        {
+            tok->text = tokens[i].first_seg;
+            tok->first_seg = 0;
+        }
+    }
+    return first;
+}
+
+/*
+ * Emits a command to run with op: its tokens and its source text, used for timelog records and job listings
+ */
+void ir_emit_run(Program *prog, uint32_t op, const Token *tokens, int count, const char *source, size_t source_len)
+{
+    if (count == 0) return;
+    uint32_t first = ir_add_tokens(prog, tokens, count);
+    ir_emit(prog, op, first, count, ir_add_string(prog, source, source_len));
+}
+
+/*
+ * Frees a program and everything in it
+ */
+void program_free(Program *prog)
+{
+    if (prog == NULL) return;
+    free(prog->code);
+    free(prog->tokens);
+    free(prog->segs);
+    free(prog->slots);
+    free(prog->pool);
+    free(prog);
+}
+
+/*
+ * get_local for compiled blocks. *pos caches one more than where the variable was last found, 0 if
+ * not yet, and is checked before use, since compaction after unset moves variables.
+ */
+char *get_local_cached(const char *name, unsigned int hash, int32_t *pos)
+{
+    if (*pos > 0 && *pos <= num_local_variables)
+    {
+        LocalVar *var = &local_variables[*pos - 1];
+        if (var->name != NULL && var->hash == hash && strcmp(var->name, name) == 0) return var->value;
+    }
+
+    int slot = find_var_slot(name, hash);
+    if (slot < 0) return NULL;
+    *pos = var_index[slot] + 1;
+    return local_variables[var_index[slot]].value;
+}
+
+/*
+ * Appends one compiled segment to a word, expanding variables, $(...) and $((...)) now.
+ * Returns -1 after reporting a failed arithmetic expansion.
+ */
+int ir_expand_segment(Program *prog, uint32_t index, WordBuf *word)
+{
+    Segment *seg = &prog->segs[index];
+    const char *text = prog->pool + seg->offset;
+    if (seg->type == SEG_LIT) word_append(word, text, seg->len);
+    else if (seg->type == SEG_VAR)
+    {
+        const char *value = getenv(text);
+        if (value == NULL) value = get_local_cached(text, seg->hash, &prog->slots[index]);
+        if (value != NULL) word_append(word, value, strlen(value));
+    }
+    else if (seg->type == SEG_ARITH)
+    {
+        int64_t value;
+        if (arith_eval(text, &value) < 0) return -1;
+        char number[24];
+        word_append(word, number, snprintf(number, sizeof(number), "%lld", (long long)value));
+    }
+    else command_substitution(text, word);
+    return 0;
+}
+
+/*
+ * Builds a compiled word from its segments in the line arena.
+ * Returns NULL after reporting a failed arithmetic expansion.
+ */
+char *ir_expand_word(Program *prog, uint32_t first, uint32_t nsegs)
+{
+    WordBuf word;
+    word.cap = 64;
+    word.data = arena_alloc(&line_arena, word.cap);
+    word.len = 0;
+    word.lit_start = 0;
+    word.in_quotes = 0;
+
+    for (uint32_t i = 0; i < nsegs; i++)
+    {
+        if (ir_expand_segment(prog, first + i, &word) < 0) return NULL;
+    }
+
+    word.data[word.len] = '\0';
+    return word.data;
+}
+
+/*
+ * Expands a for loop's compiled word list into malloc'd words. What unquoted variables and $(...) expand to
+ * is split at blanks and newlines, so for x in $(cmd) and for x in $LIST loop over each field, while
+ * literal text and double quoted expansions stay whole. A quoted word that expands to nothing is kept.
+ * Returns NULL after reporting a failed arithmetic expansion.
+ */
+char **ir_expand_fields(Program *prog, uint32_t first, uint32_t count, uint32_t *nfields)
+{
+    char **fields = NULL;
+    uint32_t n = 0;
+    uint32_t cap = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        IrToken *src = &prog->tokens[first + i];
+        if (src->type != TOK_WORD) continue;
+
+        if (src->nsegs == 0)
+        {
+            const char *text = prog->pool + src->text;
+            if (text[0] == '\0' && !src->quoted) continue;
+            fields = grow_array(fields, n, &cap, sizeof(char *));
+            fields[n++] = strdup(text);
+            continue;
+        }
+
+        WordBuf field;
+        field.cap = 64;
+        field.data = arena_alloc(&line_arena, field.cap);
+        field.len = 0;
+        field.lit_start = 0;
+        field.in_quotes = 0;
+        int have = 0;      // The field being built is a word even if empty
+        int produced = 0;  // This token already gave at least one field
+
+        for (uint32_t j = 0; j < src->nsegs; j++)
+        {
+            uint32_t index = src->first_seg + j;
+            Segment *seg = &prog->segs[index];
+            if (seg->type == SEG_LIT || seg->quoted)
+            {
+                if (ir_expand_segment(prog, index, &field) < 0) goto failed;
+                have = 1;
+                continue;
+            }
+
+            WordBuf value;
+            value.cap = 64;
+            value.data = arena_alloc(&line_arena, value.cap);
+            value.len = 0;
+            value.lit_start = 0;
+            value.in_quotes = 0;
+            if (ir_expand_segment(prog, index, &value) < 0) goto failed;
+
+            for (size_t k = 0; k < value.len; k++)
+            {
+                char c = value.data[k];
+                if (c != ' ' && c != '\t' && c != '\n')
+                {
+                    word_append(&field, &c, 1);
+                    have = 1;
+                }
+                else if (have)
+                {
+                    fields = grow_array(fields, n, &cap, sizeof(char *));
+                    fields[n++] = strndup(field.data, field.len);
+                    field.len = 0;
+                    have = 0;
+                    produced = 1;
+                }
+            }
+        }
+
+        if (have || (!produced && src->quoted))
+        {
+            fields = grow_array(fields, n, &cap, sizeof(char *));
+            fields[n++] = strndup(field.data, field.len);
+        }
+    }
+
+    // An empty list is still a list, NULL means failure
+    if (fields == NULL && (fields = malloc(sizeof(char *))) == NULL)
+    {
+        perror("malloc");
+        exit(-1);
+    }
+    *nfields = n;
+    return fields;
+
+failed:
+    for (uint32_t i = 0; i < n; i++) free(fields[i]);
+    free(fields);
+    return NULL;
+}
+
+/*
+ * Expands count compiled tokens into a TOK_END terminated array in the line arena, without lexing again.
+ * Words that expand to nothing without quotes are dropped, as in lex_command.
+ * Returns NULL if an arithmetic expansion failed.
+ */
+Token *ir_expand(Program *prog, uint32_t first, uint32_t count)
+{
+    Token *tokens = arena_alloc(&line_arena, (count + 1) * sizeof(Token));
+    int n = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        IrToken *src = &prog->tokens[first + i];
+        Token *tok = &tokens[n];
+        tok->type = src->type;
+        tok->quoted = src->quoted;
+
+        if (src->type == TOK_WORD && src->nsegs == 0)
+        {
+            // Literal words are copied, since commands may modify their arguments
+            const char *text = prog->pool + src->text;
+            tok->text = arena_strndup(&line_arena, text, strlen(text));
+            if (tok->text[0] == '\0' && !src->quoted) continue;
+        }
+        else if (src->type == TOK_WORD)
+        {
+            tok->text = ir_expand_word(prog, src->first_seg, src->nsegs);
+            if (tok->text == NULL) return NULL;
+            if (tok->text[0] == '\0' && !src->quoted) continue;
+        }
+        else
+        {
+            tok->text = prog->pool + src->text;
+            if (src->type == TOK_REDIR)
+            {
+                tok->redir.fd = src->fd;
+                tok->redir.both = src->both;
+                tok->redir.flags = src->flags;
+                tok->redir.filename = ir_expand_word(prog, src->first_seg, src->nsegs);
+                if (tok->redir.filename == NULL) return NULL;
+            }
+        }
+        n++;
+    }
+    tokens[n].type = TOK_END;
+    tokens[n].text = NULL;
+    return tokens;
+}
+
+/*
+ * Runs a compiled block. Each command's expansions live in the line arena only until it finishes,
+ * so long loops run in constant memory.
+ */
+void run_program(Program *prog)
+{
+    ForLoop *loops = NULL;
+    uint32_t nloops = 0;
+    uint32_t loops_cap = 0;
+
+    // Script line being run, for whole-script programs
+    const char *line_text = "";
+    int line_ran = 0;
+
+    uint32_t pc = 0;
+    while (pc < prog->ncode)
+    {
+        Instr *instr = &prog->code[pc++];
+        ArenaMark mark = arena_mark(&line_arena);
+
+        switch (instr->op)
+        {
+            case OP_RUN:
+            {
+                Token *tokens = ir_expand(prog, instr->a, instr->b);
+                if (tokens == NULL) return_var = -1;
+                else if (tokens[0].type != TOK_END) execute_commands(tokens, prog->pool + instr->c, strlen(prog->pool + instr->c), 1);
+                break;
+            }
+            case OP_RUN_LINE:
+            {
+                Token *tokens = ir_expand(prog, instr->a, instr->b);
+                if (tokens == NULL) return_var = -1;
+                else if (tokens[0].type != TOK_END) execute_commands(tokens, line_text, strlen(line_text), 0);
+                break;
+            }
+            case OP_LINE:
+                // The per-line work run_script does between lines
+#ifdef WSH_BENCH
+                if (line_ran) bench_end();
+                bench_begin();
+#endif
+                line_ran = instr->b;
+                line_text = prog->pool + instr->a;
+                notify_jobs();
+                break;
+            case OP_HISTORY:
+                add_history(prog->pool + instr->a, strlen(prog->pool + instr->a));
+                break;
+            case OP_JUMP:
+                pc = instr->a;
+                break;
+            case OP_JUMP_IF_FALSE:
+                if (return_var != 0) pc = instr->a;
+                break;
+            case OP_FOR_INIT:
+            {
+                // The word list is expanded and split once, when the loop starts.
+                // A failed expansion leaves the loop with no words.
+                uint32_t count = 0;
+                char **words = ir_expand_fields(prog, instr->a, instr->b, &count);
+                if (words == NULL) return_var = -1;
+
+                loops = grow_array(loops, nloops, &loops_cap, sizeof(ForLoop));
+                ForLoop *loop = &loops[nloops++];
+                loop->words = words;
+                loop->count = count;
+                loop->next = 0;
+                break;
+            }
+            case OP_FOR_NEXT:
+            {
+                if (nloops == 0)
+                {
+                    pc = instr->b;
+                    break;
+                }
+                ForLoop *loop = &loops[nloops - 1];
+                if (loop->next < loop->count) set_local(prog->pool + instr->a, loop->words[loop->next++]);
+                else
+                {
+                    for (uint32_t i = 0; i < loop->count; i++) free(loop->words[i]);
+                    free(loop->words);
+                    nloops--;
+                    pc = instr->b;
+                }
+                break;
+            }
+        }
+
+        arena_release(&line_arena, mark);
+    }
+
+#ifdef WSH_BENCH
+    if (line_ran) bench_end();
+#else
+    (void)line_ran;
+#endif
+    free(loops);
+}
+
+/*
+ * Returns the length of keyword if the text up to end starts with it as a whole word, otherwise 0
+ */
+size_t starts_keyword(const char *text, const char *end, const char *keyword)
+{
+    size_t len = strlen(keyword);
+    if ((size_t)(end - text) < len || memcmp(text, keyword, len) != 0) return 0;
+    if (text + len == end || text[len] == ' ' || text[len] == '\t' || text[len] == ';') return len;
+    return 0;
+}
+
+/*
+ * Checks whether the text up to end starts with a reserved word, so it belongs to the block compiler
+ */
+int starts_block(const char *text, const char *end)
+{
+    static const char *keywords[] = { "if", "then", "else", "fi", "while", "for", "do", "done" };
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
+    {
+        if (starts_keyword(text, end, keywords[i])) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Checks whether a compiled statement's first token is the reserved word keyword, written plainly
+ */
+int is_keyword(const Token *tok, const char *keyword)
+{
+    return tok->type == TOK_WORD && !tok->quoted && tok->nsegs == 0 && strcmp(tok->text, keyword) == 0;
+}
+
+/*
+ * Drops the block being compiled after a syntax error
+ */
+void compile_abort()
+{
+    program_free(compiling_program);
+    compiling_program = NULL;
+    num_open_blocks = 0;
+}
+
+/*
+ * Lexes one statement at *p, in text running to end, without expanding it and adds it to prog, moving *p past it.
+ * A plain statement outside any block is emitted as OP_RUN_LINE, which only whole-script compiles produce.
+ * Returns 0, or -1 after a syntax error, leaving the caller to drop the program.
+ */
+int compile_step(Program *prog, const char **p, const char *end)
+{
+    OpenBlock *top = (num_open_blocks > 0) ? &open_blocks[num_open_blocks - 1] : NULL;
+
+    // then, else and do only mark where a branch or body starts. What follows them is a statement of its own,
+    // which may open a nested block.
+    size_t marker = 0;
+    if ((marker = starts_keyword(*p, end, "then")) > 0 && top != NULL && top->kind == BLOCK_IF && top->stage == BLOCK_COND)
+    {
+        top->patch = ir_emit(prog, OP_JUMP_IF_FALSE, 0, 0, 0);
+        top->stage = BLOCK_BODY;
+    }
+    else if ((marker = starts_keyword(*p, end, "else")) > 0 && top != NULL && top->kind == BLOCK_IF && top->stage == BLOCK_BODY)
+    {
+        // The then branch jumps over the else branch
+        uint32_t jump = ir_emit(prog, OP_JUMP, 0, 0, 0);
+        prog->code[top->patch].a = prog->ncode;
+        top->patch = jump;
+        top->stage = BLOCK_ELSE;
+    }
+    else if ((marker = starts_keyword(*p, end, "do")) > 0 && top != NULL && top->kind != BLOCK_IF && top->stage == BLOCK_COND)
+    {
+        if (top->kind == BLOCK_WHILE) top->patch = ir_emit(prog, OP_JUMP_IF_FALSE, 0, 0, 0);
+        else
+        {
+            top->start = prog->ncode;
+            top->patch = ir_emit(prog, OP_FOR_NEXT, top->var, 0, 0);
+        }
+        top->stage = BLOCK_BODY;
+    }
+    if (marker > 0)
+    {
+        *p += marker;
+        return 0;
+    }
+
+    const char *start = *p;
+    compile_target = prog;
+    Token *tokens = lex_command(p, end);
+    compile_target = NULL;
+    if (tokens == NULL) return -1;
+
+    int ntokens = 0;
+    while (tokens[ntokens].type != TOK_END) ntokens++;
+    if (ntokens == 0) return 0;
+
+    // The statement's source without the ; that ended it, and without its leading keyword
+    const char *stop = *p;
+    while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t' || stop[-1] == ';')) stop--;
+    const char *body = start + strlen(tokens[0].text);
+    while (body < stop && (*body == ' ' || *body == '\t')) body++;
+    if (body > stop) body = stop;
+
+    const char *keyword = tokens[0].text;
+
+    if (is_keyword(&tokens[0], "if") || is_keyword(&tokens[0], "while"))
+    {
+        open_blocks = grow_array(open_blocks, num_open_blocks, &open_blocks_capacity, sizeof(OpenBlock));
+        top = &open_blocks[num_open_blocks++];
+        top->kind = (keyword[0] == 'i') ? BLOCK_IF : BLOCK_WHILE;
+        top->stage = BLOCK_COND;
+        top->start = prog->ncode;
+        ir_emit_run(prog, OP_RUN, tokens + 1, ntokens - 1, body, stop - body);
+    }
+    else if (is_keyword(&tokens[0], "for"))
+    {
+        // for NAME in WORDS...
+        if (ntokens < 3 || tokens[1].type != TOK_WORD || tokens[1].quoted || tokens[1].nsegs != 0
+            || !is_keyword(&tokens[2], "in"))
+        {
+            syntax_error("wsh: syntax error: for NAME in WORDS...\n");
+            return -1;
+        }
+        for (int i = 3; i < ntokens; i++)
+        {
+            if (tokens[i].type != TOK_WORD)
+            {
+                syntax_error("wsh: syntax error near '%s'\n", tokens[i].text);
+                return -1;
+            }
+        }
+        uint32_t first = ir_add_tokens(prog, tokens + 3, ntokens - 3);
+        ir_emit(prog, OP_FOR_INIT, first, ntokens - 3, 0);
+
+        open_blocks = grow_array(open_blocks, num_open_blocks, &open_blocks_capacity, sizeof(OpenBlock));
+        top = &open_blocks[num_open_blocks++];
+        top->kind = BLOCK_FOR;
+        top->stage = BLOCK_COND;
+        top->var = ir_add_string(prog, tokens[1].text, strlen(tokens[1].text));
+    }
+    else if (is_keyword(&tokens[0], "fi") && ntokens == 1 && top != NULL && top->kind == BLOCK_IF && top->stage != BLOCK_COND)
+    {
+        prog->code[top->patch].a = prog->ncode;
+        num_open_blocks--;
+    }
+    else if (is_keyword(&tokens[0], "done") && ntokens == 1 && top != NULL && top->kind != BLOCK_IF && top->stage == BLOCK_BODY)
+    {
+        ir_emit(prog, OP_JUMP, top->start, 0, 0);
+        if (top->kind == BLOCK_WHILE) prog->code[top->patch].a = prog->ncode;
+        else prog->code[top->patch].b = prog->ncode;
+        num_open_blocks--;
+    }
+    else if (is_keyword(&tokens[0], "then") || is_keyword(&tokens[0], "else") || is_keyword(&tokens[0], "fi")
+             || is_keyword(&tokens[0], "do") || is_keyword(&tokens[0], "done"))
+    {
+        syntax_error("wsh: syntax error near '%s'\n", keyword);
+        return -1;
+    }
+    else ir_emit_run(prog, (num_open_blocks > 0) ? OP_RUN : OP_RUN_LINE, tokens, ntokens, start, stop - start);
+
+    return 0;
+}
+
+/*
+ * Compiles one statement at *p, in text running to end, into the block being typed, moving *p past it. When the statement
+ * closes the outermost block, the block is run and freed.
+ * Returns 1 if a block ran, 0 while it is still open, or -1 after a syntax error, which drops the block.
+ */
+int compile_statement(const char **p, const char *end)
+{
+    if (compiling_program == NULL)
+    {
+        compiling_program = calloc(1, sizeof(Program));
+        if (compiling_program == NULL)
+        {
+            perror("calloc");
+            exit(-1);
+        }
+    }
+    Program *prog = compiling_program;
+    if (compile_step(prog, p, end) < 0)
+    {
+        compile_abort();
+        return -1;
+    }
+
+    if (num_open_blocks > 0) return 0;
+
+    // The outermost block is closed, the compiler is free again before the block runs
+    compiling_program = NULL;
+    run_program(prog);
+    program_free(prog);
+    return 1;
+}
+
+/*
+ * Runs the text up to end, a line of one or more ;-separated commands. Plain commands are lexed and
+ * run one at a time, so each sees the variables the previous one set. if, while and for blocks are
+ * compiled once and run when closed, and may span several lines. Unless from_history is set the
+ * text is also the line recorded in history.
+ * Returns 1 if anything ran.
+ */
+int execute_text(const char *text, const char *end, int from_history)
+{
+    const char *p = text;
+    const char *original_line = from_history ? NULL : text;
+    size_t line_len = end - text;
+    int ran = 0;
+    int opened = 0;
+
+    while (1)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ';')) p++;
+        if (p == end) break;
+
+        if (compiling_program != NULL || starts_block(p, end))
+        {
+            if (compiling_program == NULL) opened = 1;
+            int status = compile_statement(&p, end);
+            if (status < 0)
+            {
+                return_var = -1;
+                break;
+            }
+
+            // A block typed on one line is remembered like any other command line
+            if (status == 1)
+            {
+                ran = 1;
+                if (opened && original_line != NULL) add_history(original_line, line_len);
+                opened = 0;
+            }
+            continue;
+        }
+
+        Token *tokens = lex_command(&p, end);
+        if (tokens == NULL)
+        {
+            return_var = -1;
+            break;
+        }
+        if (tokens[0].type != TOK_END)
+        {
+            execute_commands(tokens, original_line, line_len, from_history);
+            ran = 1;
+        }
+    }
+
+    return ran;
+}
+
+/*
+ * Adds the len bytes of a command line as the newest history entry, unless it repeats the most recent entry.
+ * Interactive sessions also append it to the history file.
+ */
+void add_history(const char *original_line, size_t len)
+{
+    if (history_push(original_line, len) && history_fd >= 0) history_append(original_line, len);
+}
+
+/*
+ * Stores len bytes of entry as the newest entry in the history list, unless it repeats the most recent one.
+ * Returns 1 if it was stored.
+ */
+int history_push(const char *entry, size_t len)
+{
+    char *newest = history_get(1);
+    if (newest != NULL && strncmp(newest, entry, len) == 0 && newest[len] == '\0') return 0;
+
+    // Overwrite the oldest slot, reusing its buffer when the line fits
+    HistoryEntry *slot = &history_list[history_head];
+    if (slot->capacity < len + 1)
+    {
+        size_t capacity = (len + 1 < 64) ? 64 : len + 1;
+        char *grown = realloc(slot->line, capacity);
+        if (grown == NULL)
+        {
+            perror("realloc");
+            return 0;
+        }
+        slot->line = grown;
+        slot->capacity = capacity;
+    }
+    memcpy(slot->line, entry, len);
+    slot->line[len] = '\0';
+
+    history_head = (history_head + 1) % history_list_size;
+    if (history_count < history_list_size) history_count++;
+    return 1;
+}
+
+/*
+ * set -o <option> turns a shell option on and set +o <option> turns it off.
+ * set -o alone prints every option with its state. Options: pipefail, and timelog,
+ * which takes a file (set -o timelog <file>) that gets a resource record appended for every command.
+ */
+void wsh_set(char **args)
+{
+    return_var = 0;
+
+    if (args[1] == NULL || args[2] == NULL)
+    {
+        if (args[1] != NULL && strcmp(args[1], "-o") == 0)
+        {
+            printf("pipefail\t%s\n", opt_pipefail ? "on" : "off");
+            printf("timelog\t%s\n", (timelog_fd >= 0) ? "on" : "off");
+            return;
+        }
+        fprintf(stderr, "set: usage: set -o|+o <option>\n");
+        return_var = -1;
+        return;
+    }
+
+    int enable;
+    if (strcmp(args[1], "-o") == 0) enable = 1;
+    else if (strcmp(args[1], "+o") == 0) enable = 0;
+    else
+    {
+        fprintf(stderr, "set: usage: set -o|+o <option>\n");
+        return_var = -1;
+        return;
+    }
+
+    if (strcmp(args[2], "pipefail") == 0) opt_pipefail = enable;
+    // set -o timelog <file> appends a resource record for every command to file
+    else if (strcmp(args[2], "timelog") == 0)
+    {
+        if (timelog_fd >= 0) close(timelog_fd);
+        timelog_fd = -1;
+        if (!enable) return;
+
+        if (args[3] == NULL)
+        {
+            fprintf(stderr, "set: usage: set -o timelog <file>\n");
+            return_var = -1;
+            return;
+        }
+        timelog_fd = open(args[3], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (timelog_fd < 0)
+        {
+            perror("set: timelog");
+            return_var = -1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "set: %s: invalid option name\n", args[2]);
+        return_var = -1;
+    }
+}
+
+// One input's run under parallel, with its captured stdout
+typedef struct ParallelJob
+{
+    pid_t pid;
+    int fd;             // Read end of the job's stdout pipe, -1 once at EOF
+    int exited;
+    int status;
+    int lost;           // Output could not be buffered, so the job counts as failed
+    char *output;
+    size_t len;
+    size_t capacity;
+} ParallelJob;
+
+/*
+ * Builds one job's argv from the template, replacing every {} with input.
+ * Without any {} the input is appended as the last argument.
+ * Returns NULL if memory ran out, never a partial argv.
+ */
+char **parallel_argv(char **template, int template_len, const char *input)
+{
+    char **argv = calloc(template_len + 2, sizeof(char *));
+    if (argv == NULL) return NULL;
+
+    int substituted = 0;
+    size_t input_len = strlen(input);
+    for (int i = 0; i < template_len; i++)
+    {
+        // Count the {} markers to size the result
+        int markers = 0;
+        for (const char *p = strstr(template[i], "{}"); p != NULL; p = strstr(p + 2, "{}")) markers++;
+
+        argv[i] = malloc(strlen(template[i]) + markers * input_len + 1);
+        if (argv[i] == NULL) goto out_of_memory;
+
+        char *out = argv[i];
+        for (const char *p = template[i]; *p != '\0'; )
+        {
+            if (p[0] == '{' && p[1] == '}')
+            {
+                memcpy(out, input, input_len);
+                out += input_len;
+                p += 2;
+                substituted = 1;
+            }
+            else *out++ = *p++;
+        }
+        *out = '\0';
+    }
+    if (!substituted && (argv[template_len] = strdup(input)) == NULL) goto out_of_memory;
+    return argv;
+
+out_of_memory:
+    for (int i = 0; i < template_len; i++) free(argv[i]);
+    free(argv);
+    return NULL;
+}
+
+/*
+ * Reads every line of fd into a NULL terminated array of inputs, stored in one buffer
+ */
+char **read_input_lines(int fd, char **buffer_out)
+{
+    size_t len = 0, capacity = 4096;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL) return NULL;
+
+    ssize_t nread;
+    while (buffer != NULL && (nread = read(fd, buffer + len, capacity - len - 1)) != 0)
+    {
+        if (nread < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+        len += nread;
+        if (capacity - len - 1 == 0)
+        {
+            capacity *= 2;
+            char *grown = realloc(buffer, capacity);
+            if (grown == NULL) free(buffer);
+            buffer = grown;
+        }
+    }
+    if (buffer == NULL) return NULL;
+    buffer[len] = '\0';
+
+    // Split in place at each newline
+    size_t ninputs = 0;
+    for (size_t i = 0; i < len; i++) if (buffer[i] == '\n') ninputs++;
+    char **inputs = malloc((ninputs + 2) * sizeof(char *));
+    if (inputs == NULL)
+    {
+        free(buffer);
+        return NULL;
+    }
+
+    ninputs = 0;
+    char *line = buffer;
+    while (*line != '\0')
+    {
+        char *newline = strchr(line, '\n');
+        if (newline != NULL) *newline = '\0';
+        if (*line != '\0') inputs[ninputs++] = line;
+        if (newline == NULL) break;
+        line = newline + 1;
+    }
+    inputs[ninputs] = NULL;
+
+    *buffer_out = buffer;
+    return inputs;
+}
+
+/*
+ * parallel [-j N] cmd args... {} ... ::: in1 in2 ..., or with no ::: one input per line of stdin.
+ * Runs cmd once per input with at most N (default: online CPUs) in flight, starting the next
+ * as soon as any finishes. Each job's stdout is captured and written out in input order, so
+ * outputs never interleave; stderr is passed straight through.
+ * return_var is the number of failed jobs, capped at 101.
+ */
+void wsh_parallel(char **args)
+{
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-j") == 0 && args[i + 1] != NULL)
+    {
+        max_jobs = atol(args[i + 1]);
+        i += 2;
+    }
+    if (max_jobs < 1) max_jobs = 1;
+
+    // Template runs up to ::: or the end of the line
+    char **template = &args[i];
+    int template_len = 0;
+    while (template[template_len] != NULL && strcmp(template[template_len], ":::") != 0) template_len++;
+    if (template_len == 0)
+    {
+        fprintf(stderr, "parallel: usage: parallel [-j N] cmd [args...] [::: inputs...]\n");
+        return_var = -1;
+        return;
+    }
+
+    char **inputs;
+    char *input_buffer = NULL;
+    if (template[template_len] != NULL) inputs = &template[template_len + 1];
+    else inputs = read_input_lines(STDIN_FILENO, &input_buffer);
+    if (inputs == NULL)
+    {
+        perror("parallel");
+        return_var = -1;
+        return;
+    }
+
+    int ninputs = 0;
+    while (inputs[ninputs] != NULL) ninputs++;
+
+    // The command is resolved once for every job
+    const Builtin *builtin = find_builtin(template[0]);
+    const char *full_path = (builtin == NULL) ? resolve_command(template[0]) : NULL;
+    if (builtin == NULL && full_path == NULL)
+    {
+        fprintf(stderr, "%s: command not found\n", template[0]);
+        free(input_buffer);
+        if (input_buffer != NULL) free(inputs);
+        return_var = -1;
+        return;
+    }
+
+    ParallelJob *jobs_run = calloc(ninputs > 0 ? ninputs : 1, sizeof(ParallelJob));
+    struct pollfd *fds = malloc((ninputs + 1) * sizeof(struct pollfd));
+    int *fd_job = malloc((ninputs + 1) * sizeof(int));
+    if (jobs_run == NULL || fds == NULL || fd_job == NULL)
+    {
+        perror("malloc");
+        free(jobs_run);
+        free(fds);
+        free(fd_job);
+        free(input_buffer);
+        if (input_buffer != NULL) free(inputs);
+        return_var = -1;
+        return;
+    }
+
+    fflush(stdout);
+    int next = 0;       // Next input to start
+    int emitted = 0;    // Jobs whose output has been written
+    int running = 0;    // Started and not yet exited
+    int failed = 0;
+
+    while (emitted < ninputs)
+    {
+        // Keep max_jobs children in flight
+        while (running < max_jobs && next < ninputs)
+        {
+            ParallelJob *job = &jobs_run[next];
+            int pipe_fds[2];
+            char **argv = parallel_argv(template, template_len, inputs[next]);
+
+            job->fd = -1;
+            job->pid = -1;
+            if (argv != NULL && pipe2(pipe_fds, O_CLOEXEC) == 0)
+            {
+                if (builtin != NULL) job->pid = spawn_builtin(builtin, argv, -1, pipe_fds[1], NULL, 0, -1);
+                else job->pid = wsh_spawn(full_path, argv, -1, pipe_fds[1], NULL, 0, -1);
+                close(pipe_fds[1]);
+                job->fd = pipe_fds[0];
+            }
+            else perror("parallel");
+
+            if (argv != NULL)
+            {
+                for (int a = 0; argv[a] != NULL || a < template_len; a++) free(argv[a]);
+                free(argv);
+            }
+
+            if (job->pid > 0) running++;
+            else
+            {
+                // Could not start, counts as a finished failure
+                if (job->fd >= 0) close(job->fd);
+                job->fd = -1;
+                job->exited = 1;
+                job->status = -1;
+            }
+            next++;
+        }
+
+        // Wait for output from any running job, or for one of them to exit
+        int nfds = 0;
+        for (int j = emitted; j < next; j++)
+        {
+            if (jobs_run[j].fd < 0) continue;
+            fds[nfds].fd = jobs_run[j].fd;
+            fds[nfds].events = POLLIN;
+            fd_job[nfds++] = j;
+        }
+        fds[nfds].fd = sigchld_pipe[0];
+        fds[nfds].events = POLLIN;
+
+        // Without a SIGCHLD pipe an exit can only be noticed by checking again
+        int ready = 1;
+        if (nfds > 0 || running > 0) ready = poll(fds, nfds + 1, (sigchld_pipe[0] < 0) ? 10 : -1);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+
+        for (int f = 0; ready > 0 && f < nfds; f++)
+        {
+            if (fds[f].revents == 0) continue;
+            ParallelJob *job = &jobs_run[fd_job[f]];
+
+            if (job->capacity - job->len < 4096)
+            {
+                size_t capacity = (job->capacity > 0) ? job->capacity * 2 : 16384;
+                char *grown = realloc(job->output, capacity);
+                if (grown == NULL)
+                {
+                    // Stop reading this job, its pipe would otherwise stay readable forever
+                    perror("realloc");
+                    close(job->fd);
+                    job->fd = -1;
+                    job->lost = 1;
+                    continue;
+                }
+                job->output = grown;
+                job->capacity = capacity;
+            }
+
+            ssize_t nread = read(job->fd, job->output + job->len, job->capacity - job->len);
+            if (nread > 0) job->len += nread;
+            else if (nread == 0 || errno != EINTR)
+            {
+                close(job->fd);
+                job->fd = -1;
+            }
+        }
+
+        // Collect every job that exited, only ever waiting on our own pids
+        char drain[64];
+        while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0);
+        for (int j = emitted; j < next; j++)
+        {
+            ParallelJob *job = &jobs_run[j];
+            if (job->exited) continue;
+
+            // Never block here, a job may close its output long before it exits
+            int status;
+            if (waitpid(job->pid, &status, WNOHANG) == job->pid)
+            {
+                job->exited = 1;
+                job->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+                running--;
+            }
+        }
+
+        // Write out finished jobs in input order
+        while (emitted < next && jobs_run[emitted].exited && jobs_run[emitted].fd < 0)
+        {
+            ParallelJob *job = &jobs_run[emitted];
+            if (job->len > 0 && write_all(STDOUT_FILENO, job->output, job->len) < 0) perror("write");
+            if (job->status != 0 || job->lost) failed++;
+            free(job->output);
+            job->output = NULL;
+            emitted++;
+        }
+    }
+
+    free(jobs_run);
+    free(fds);
+    free(fd_job);
+    free(input_buffer);
+    if (input_buffer != NULL) free(inputs);
+
+    return_var = (failed > 101) ? 101 : failed;
+}
+
+// Built-in registry, kept sorted by name for find_builtin's binary search.
+// A new built-in only needs an entry here.
+const Builtin builtins[] =
+{
+    { ".",       wsh_source,  BUILTIN_STDIO },
+    { "[",       wsh_test,    BUILTIN_STDIO | BUILTIN_HISTORY },
+    { "bg",      wsh_bg,      BUILTIN_STDIO },
+    { "cat",     wsh_cat,     BUILTIN_STDIO | BUILTIN_HISTORY },
+    { "cd",      wsh_cd,      BUILTIN_STDIO },
+    { "echo",    wsh_echo,    BUILTIN_STDIO | BUILTIN_HISTORY },
+    { "exec",    wsh_exec,    BUILTIN_KEEP_REDIRECTS },
+    { "exit",    wsh_exit,    BUILTIN_STDIO },
+    { "export",  wsh_export,  BUILTIN_STDIO },
+    { "false",   wsh_false,   BUILTIN_HISTORY },
+    { "fg",      wsh_fg,      BUILTIN_STDIO },
+    { "hash",    wsh_hash,    BUILTIN_STDIO },
+    { "history", wsh_history, BUILTIN_STDIO },
+    { "jobs",    wsh_jobs,    BUILTIN_STDIO },
+    { "let",     wsh_let,     BUILTIN_STDIO },
+    { "local",   wsh_local,   BUILTIN_STDIO },
+    { "ls",      wsh_ls,      BUILTIN_STDIO },
+    { "parallel", wsh_parallel, BUILTIN_STDIO | BUILTIN_HISTORY },
+    { "printf",  wsh_printf,  BUILTIN_STDIO | BUILTIN_HISTORY },
+    { "set",     wsh_set,     BUILTIN_STDIO },
+    { "source",  wsh_source,  BUILTIN_STDIO },
+    { "test",    wsh_test,    BUILTIN_STDIO | BUILTIN_HISTORY },
+    { "time",    wsh_time,    BUILTIN_STDIO | BUILTIN_HISTORY },
+    { "timeout", wsh_timeout, BUILTIN_STDIO | BUILTIN_HISTORY },
+    { "true",    wsh_true,    BUILTIN_HISTORY },
+    { "vars",    wsh_vars,    BUILTIN_STDIO },
+    { "wait",    wsh_wait,    BUILTIN_STDIO },
+};
+
+#define NUM_BUILTINS (int)(sizeof(builtins) / sizeof(builtins[0]))
+
+/*
+ * Checks once at startup that the registry is sorted, since an entry out of place would make
+ * find_builtin miss other built-ins and send them to $PATH instead
+ */
+void check_builtins()
+{
+    for (int i = 1; i < NUM_BUILTINS; i++) assert(strcmp(builtins[i - 1].name, builtins[i].name) < 0);
+}
+
+/*
+ * Looks a command name up in the built-in registry, returns NULL if it is not a built-in
+ */
+const Builtin *find_builtin(const char *name)
+{
+    int low = 0;
+    int high = NUM_BUILTINS - 1;
+    while (low <= high)
+    {
+        int mid = (low + high) / 2;
+        int cmp = strcmp(name, builtins[mid].name);
+        if (cmp == 0) return &builtins[mid];
+        if (cmp < 0) high = mid - 1;
+        else low = mid + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Runs one command line, with a timelog record for every outermost command when set -o timelog is on
+ */
+void execute_commands(Token *tokens, const char *original_line, size_t line_len, int from_history)
+{
+    if (timelog_fd < 0 || command_depth > 0)
+    {
+        command_depth++;
+        run_command(tokens, original_line, line_len, from_history);
+        command_depth--;
+        return;
+    }
+
+    // The logged text is taken before the command runs
+    char *command = (original_line != NULL) ? strndup(original_line, line_len) : join_tokens(tokens);
+    Measurement m;
+    CommandTimes times;
+
+    measure_begin(&m);
+    command_depth++;
+    run_command(tokens, original_line, line_len, from_history);
+    command_depth--;
+    measure_end(&m, &times);
+
+    // set +o timelog may have run
+    if (timelog_fd >= 0 && command != NULL) write_timelog(&times, command);
+    free(command);
+}
+
+void run_command(Token *tokens, const char *original_line, size_t line_len, int from_history)
+{
+    // A trailing & runs the command as a background job
+    int background = 0;
+    int last = 0;
+    while (tokens[last].type != TOK_END) last++;
+    if (last > 0 && tokens[last - 1].type == TOK_AMP)
+    {
+        tokens[last - 1].type = TOK_END;
+        background = 1;
+    }
+
+    // Pipelines and background jobs run as a unit and are always recorded in history
+    int is_pipeline = background;
+    for (int p = 0; tokens[p].type != TOK_END; p++) if (tokens[p].type == TOK_PIPE) is_pipeline = 1;
+    if (is_pipeline && tokens[0].type != TOK_END)
+    {
+        if (execute_pipeline(tokens, background, original_line, line_len) == 0 && original_line != NULL && from_history == 0)
+        {
+            add_history(original_line, line_len);
+        }
+        return;
+    }
+
+    // The lexer already parsed the redirections, they are collected into a plan here and opened later //
+    char **args;
+    Redirect *redirs;
+    int nredirs;
+    build_command(tokens, &args, &redirs, &nredirs);
+    int cmd_executed = 0;
+
+    const Builtin *builtin = (args[0] != NULL) ? find_builtin(args[0]) : NULL;
+
+    // Built-ins run in the shell, so only they save and restore the descriptors their redirections replace.
+    // External commands open their redirections in the child.
+    SavedFd *saved = NULL;
+    int nsaved = 0;
+    int redirect_failed = 0;
+    if (builtin != NULL && nredirs > 0)
+    {
+        if (builtin->flags & BUILTIN_STDIO)
+        {
+            saved = arena_alloc(&line_arena, 2 * nredirs * sizeof(SavedFd));
+            nsaved = save_fds(redirs, nredirs, saved);
+            apply_redirects(redirs, nredirs);
+        }
+        // exec keeps its redirections, and does not run its command if one fails.
+        // Output buffered so far belongs to the old descriptors.
+        else if (builtin->flags & BUILTIN_KEEP_REDIRECTS)
+        {
+            fflush(stdout);
+            fflush(stderr);
+            redirect_failed = (apply_redirects(redirs, nredirs) < 0);
+        }
+        // The rest never touch stdio, their redirection targets are only created
+        else touch_redirects(redirs, nredirs);
+    }
+
+    if (args[0] == NULL)
+    {
+        // Only redirections, nothing to run
+    }
+    // BUILT-IN PROCESSING //
+    else if (builtin != NULL)
+    {
+        if (!redirect_failed) builtin->handler(args);
+        cmd_executed = 1;
+    }
+
+    // EXTERNAL COMMANDS //
+    else
+    {
+        // Relative / Full path check, otherwise resolve through $PATH and the command cache
+        const char *full_path = resolve_command(args[0]);
+
+        int status;
+        if (full_path != NULL)
+        {
+            cmd_executed = 1;
+
+            // The zygote creates the child when it is running
+            if (zygote_run(full_path, args, redirs, nredirs, &status) == 0) return_var = status;
+            else
+            {
+                pid_t pid = wsh_spawn(full_path, args, -1, -1, redirs, nredirs, -1);
+                pid_t *pids = malloc(sizeof(pid_t));
+                if (pid < 0 || pids == NULL)
+                {
+                    free(pids);
+                    return_var = -1;
+                }
+                // Wait for child(executable) to finish
+                else
+                {
+                    pids[0] = pid;
+                    if (original_line != NULL) return_var = wait_foreground(pids, 1, original_line, line_len);
+                    else return_var = wait_foreground(pids, 1, args[0], strlen(args[0]));
+                }
+            }
+        }
+    }
+
+    // Store the original command in history, if not executed from history
+    if (args[0] != NULL && from_history == 0 && cmd_executed == 1 && (builtin == NULL || (builtin->flags & BUILTIN_HISTORY))) 
+    {
+        // Add the original command line to history
+        add_history(original_line, line_len);
+    }
+    // Restore whatever a built-in's redirections replaced
+    if (nsaved > 0) restore_fds(saved, nsaved);
+
+    if (cmd_executed == 0)
+    {
+        perror("Invalid command");
+        return_var = -1;
+    }
+}
+
+
+/*
+ * Makes room for len bytes and a terminator in the input line buffer
+ */
+void line_reserve(size_t len)
+{
+    if (len + 1 <= line_capacity) return;
+
+    size_t capacity = (line_capacity > 0) ? line_capacity : 128;
+    while (capacity < len + 1) capacity *= 2;
+    char *grown = realloc(line, capacity);
+    if (grown == NULL)
+    {
+        perror("realloc");
+        exit(-1);
+    }
+    line = grown;
+    line_capacity = capacity;
+}
+
+/*
+ * Redraws the terminal line: the prompt and the line typed so far, or during a reverse search its query
+ * and the entry it found
+ */
+void editor_redraw(const char *prompt, const char *query, const char *text, size_t len)
+{
+    write_all(STDOUT_FILENO, "\r\033[K", 4);
+    if (query != NULL)
+    {
+        write_all(STDOUT_FILENO, "(reverse-i-search)`", 19);
+        write_all(STDOUT_FILENO, query, strlen(query));
+        write_all(STDOUT_FILENO, "': ", 3);
+    }
+    else write_all(STDOUT_FILENO, prompt, strlen(prompt));
+    write_all(STDOUT_FILENO, text, len);
+}
+
+/*
+ * Reads one line from the terminal into line, with the terminal in raw mode: typing and backspace,
+ * ^U clears the line, ^C drops it, ^D on an empty line ends input, and ^R starts a reverse incremental
+ * search of history. During a search ^R finds the next older match, Enter runs it, ^G or ^C cancels
+ * and any other key keeps it for editing.
+ * Returns the line's length, or -1 at end of input.
+ */
+ssize_t read_line_edited(const char *prompt)
+{
+    struct termios saved;
+    if (tcgetattr(STDIN_FILENO, &saved) < 0) return getline(&line, &line_capacity, stdin);
+    struct termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    line_reserve(0);
+    size_t len = 0;
+    ssize_t result = -1;
+
+    int searching = 0;
+    char query[256];
+    size_t query_len = 0;
+    uint32_t cursor = UINT32_MAX;
+    const char *match = "";
+    size_t match_len = 0;
+
+    while (1)
+    {
+        if (job_control) wait_for_input();
+        unsigned char c;
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        if (searching)
+        {
+            if (c == 0x12 || (c >= 0x20 && c != 0x7f) || c == 0x7f || c == 0x08)
+            {
+                // Typing narrows the search from the newest entry again, ^R moves on to older ones
+                if (c == 0x7f || c == 0x08)
+                {
+                    if (query_len > 0) query_len--;
+                    cursor = UINT32_MAX;
+                }
+                else if (c != 0x12 && query_len < sizeof(query) - 1)
+                {
+                    query[query_len++] = c;
+                    cursor = UINT32_MAX;
+                }
+                query[query_len] = '\0';
+
+                const char *found;
+                size_t found_len;
+                if (query_len > 0 && history_search_next(query, &cursor, &found, &found_len))
+                {
+                    match = found;
+                    match_len = found_len;
+                }
+                editor_redraw(prompt, query, match, match_len);
+                continue;
+            }
+
+            searching = 0;
+            if (c == 0x07 || c == 0x03)
+            {
+                editor_redraw(prompt, NULL, line, len);
+                continue;
+            }
+
+            // Any other key takes the match as the line, Enter also runs it
+            line_reserve(match_len);
+            memcpy(line, match, match_len);
+            len = match_len;
+            editor_redraw(prompt, NULL, line, len);
+        }
+
+        if (c == '\r' || c == '\n')
+        {
+            write_all(STDOUT_FILENO, "\n", 1);
+            result = len;
+            break;
+        }
+        else if (c == 0x03)
+        {
+            write_all(STDOUT_FILENO, "^C\n", 3);
+            len = 0;
+            write_all(STDOUT_FILENO, prompt, strlen(prompt));
+        }
+        else if (c == 0x04)
+        {
+            if (len == 0)
+            {
+                write_all(STDOUT_FILENO, "\n", 1);
+                break;
+            }
+        }
+        else if (c == 0x7f || c == 0x08)
+        {
+            // Drop a whole UTF-8 character
+            if (len == 0) continue;
+            len--;
+            while (len > 0 && ((unsigned char)line[len] & 0xc0) == 0x80) len--;
+            write_all(STDOUT_FILENO, "\b \b", 3);
+        }
+        else if (c == 0x15)
+        {
+            len = 0;
+            editor_redraw(prompt, NULL, line, len);
+        }
+        else if (c == 0x12)
+        {
+            if (history_fd >= 0) history_index_update();
+            searching = 1;
+            query_len = 0;
+            query[0] = '\0';
+            cursor = UINT32_MAX;
+            match = "";
+            match_len = 0;
+            editor_redraw(prompt, query, match, match_len);
+        }
+        else if (c == 0x1b)
+        {
+            // Escape sequences such as the arrow keys are not supported, read past them
+            unsigned char next;
+            if (read(STDIN_FILENO, &next, 1) == 1 && (next == '[' || next == 'O'))
+            {
+                while (read(STDIN_FILENO, &next, 1) == 1 && (next < 0x40 || next > 0x7e)) { }
+            }
+        }
+        else if (c >= 0x20 || c == '\t')
+        {
+            line_reserve(len + 1);
+            line[len++] = c;
+            write_all(STDOUT_FILENO, (char *)&c, 1);
+        }
+    }
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    line_reserve(len);
+    line[len] = '\0';
+    return result;
+}
+
+/*
+ * Runs the len bytes of one input line, shared by interactive and batch mode. The line needs no
+ * terminator, so script lines run straight out of a read-only mapping. Everything the line allocates
+ * comes from the line arena, which is reset once the line has run.
+ * Returns 1 if a command ran, 0 for blank lines and comments.
+ */
+int run_line(const char *line, size_t len)
+{
+    // Drop the newline if present
+    const char *newline = memchr(line, '\n', len);
+    if (newline != NULL) len = newline - line;
+
+    // Ignore comments and empty input
+    if (len == 0 || line[0] == '#') return 0;
+
+    // A sourced script's lines run while the source command's own line is still in the arena
+    ArenaMark mark = arena_mark(&line_arena);
+
+    // Lexing leaves the line untouched, so it doubles as the history text
+    int ran = execute_text(line, line + len, 0);
+
+    arena_release(&line_arena, mark);
+    return ran;
+}
+
+void interactive_shell()
+{
+    interactive = 1;
+    job_control = isatty(STDIN_FILENO);
+    init_jobs();
+
+    // Only sessions at a terminal share history, piped input is a script in all but name
+    if (isatty(STDIN_FILENO)) history_open();
+
+    // Lines typed at a terminal go through the line editor, for ^R history search
+    int line_editing = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+
+    // On a terminal stdin is polled alongside the SIGCHLD pipe, so stdio must not read ahead of poll
+    if (job_control) setvbuf(stdin, NULL, _IONBF, 0);
+
+    // Interactive 
+    while (1)
+    {   
+        // Report jobs that finished since the last prompt
+        notify_jobs();
+
+        // Lines continuing an open block get a shorter prompt
+        const char *prompt = (compiling_program != NULL) ? "> " : "wsh> ";
+
+        // If stdout is redirected and terminal is still stdiin, then print out shell prompt
+        if (!isatty(STDOUT_FILENO) && isatty(STDIN_FILENO))
+        {
+            FILE *terminal = fopen("/dev/tty", "w");
+            fprintf(terminal, "%s", prompt);
+            fclose(terminal);
+        }
+        
+
+        printf("%s", prompt);
+        if (line_editing)
+        {
+            fflush(stdout);
+            if (read_line_edited(prompt) < 0)
+            {
+                end_of_input();
+                break;
+            }
+            run_line(line, strlen(line));
+            continue;
+        }
+        if (job_control)
+        {
+            fflush(stdout);
+            wait_for_input();
+        }
+        if (getline(&line, &line_capacity, stdin) != -1)
+        {  
+            // Forces output buffer to be fed immediately (issue earlier)
+            fflush(stdout);
+        }
+
+        // End of input
+        else
+        {
+            end_of_input();
+            break;
+        }
+
+        run_line(line, strlen(line));
+    }
+}
+
+/*
+ * Reports a block still open when input ends, and drops it
+ */
+void end_of_input()
+{
+    if (compiling_program == NULL) return;
+
+    fprintf(stderr, "wsh: unexpected end of input, block not closed\n");
+    compile_abort();
+    return_var = -1;
+}
+
+/*
+ * Sets reader up to hand out fd's lines. Regular files are mapped, anything else is read in large chunks.
+ * Returns 0, or -1 if the buffer could not be allocated.
+ */
+int script_open(ScriptReader *reader, int fd)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+
+    // Lines are only ever read, so the mapped pages stay clean page cache and never get copied
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            reader->map = map;
+            reader->end = st.st_size;
+            return 0;
+        }
+    }
+
+    reader->buf_cap = SCRIPT_CHUNK_SIZE;
+    reader->buf = malloc(reader->buf_cap);
+    if (reader->buf == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the script's next line and sets *len to its length without the newline, or returns NULL at
+ * the end. The line is not NUL terminated and stays valid until the next call. Newlines are found
+ * with memchr, which scans a vector at a time.
+ */
+const char *script_next_line(ScriptReader *reader, size_t *len)
+{
+    if (reader->map != NULL)
+    {
+        if (reader->start >= reader->end) return NULL;
+        const char *line = reader->map + reader->start;
+
+        // Pages of lines already run are dropped, so huge scripts do not stay resident
+        if (reader->start - reader->released >= SCRIPT_RELEASE_SIZE)
+        {
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t upto = reader->start & ~(page - 1);
+            madvise(reader->map + reader->released, upto - reader->released, MADV_DONTNEED);
+            reader->released = upto;
+        }
+
+        // The last line may have no newline, its end is then the end of the file
+        const char *newline = memchr(line, '\n', reader->end - reader->start);
+        *len = (newline != NULL) ? (size_t)(newline - line) : reader->end - reader->start;
+        reader->start += *len + (newline != NULL);
+        return line;
+    }
+
+    size_t scanned = reader->start;
+    while (1)
+    {
+        char *newline = memchr(reader->buf + scanned, '\n', reader->end - scanned);
+        if (newline != NULL)
+        {
+            const char *line = reader->buf + reader->start;
+            *len = newline - line;
+            reader->start = newline + 1 - reader->buf;
+            return line;
+        }
+        scanned = reader->end;
+
+        if (reader->eof)
+        {
+            if (reader->start >= reader->end) return NULL;
+            const char *line = reader->buf + reader->start;
+            *len = reader->end - reader->start;
+            reader->start = reader->end;
+            return line;
+        }
+
+        // Move the partial line to the front, growing the buffer when a chunk no longer fits after it
+        if (reader->start > 0)
+        {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            scanned -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->buf_cap - reader->end < SCRIPT_CHUNK_SIZE / 2)
+        {
+            char *grown = realloc(reader->buf, reader->buf_cap * 2);
+            if (grown == NULL)
+            {
+                perror("realloc");
+                exit(-1);
+            }
+            reader->buf = grown;
+            reader->buf_cap *= 2;
+        }
+
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->buf_cap - reader->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) perror("read");
+        if (n <= 0) reader->eof = 1;
+        else reader->end += n;
+    }
+}
+
+/*
+ * Unmaps or frees the script and closes its descriptor
+ */
+void script_close(ScriptReader *reader)
+{
+    if (reader->map != NULL) munmap(reader->map, reader->end);
+    free(reader->buf);
+    if (reader->fd >= 0) close(reader->fd);
+    reader->map = NULL;
+    reader->buf = NULL;
+    reader->fd = -1;
+}
+
+/*
+ * Compiles a whole script into prog without running any of it, for the cache. Lines that start outside
+ * any block get an OP_LINE, so the program still does run_script's per-line work.
+ * Returns 0, or -1 on a syntax error, which is left for the uncached run to report.
+ */
+int compile_script(ScriptReader *reader, Program *prog)
+{
+    int status = 0;
+    syntax_errors_quiet = 1;
+
+    const char *script_line;
+    size_t len;
+    while (status == 0 && (script_line = script_next_line(reader, &len)) != NULL)
+    {
+        // Ignore comments and empty input, as run_line does
+        if (len == 0 || script_line[0] == '#') continue;
+
+        uint32_t text = ir_add_string(prog, script_line, len);
+        uint32_t line_instr = UINT32_MAX;
+        if (num_open_blocks == 0) line_instr = ir_emit(prog, OP_LINE, text, 0, 0);
+
+        // Mirrors execute_text: a block that opens and closes on this line records the line in history
+        int opened = 0;
+        const char *p = script_line;
+        const char *end = script_line + len;
+        while (1)
         {
-            int fd = STDOUT_FILENO;  // Default to stdout
-            char *filename;
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ';')) p++;
+            if (p == end) break;
 
-            // Check if there's a digit before '>>'
-            if (args[i][0] >= '0' && args[i][0] <= '9' && args[i][1] == '>' && args[i][2] == '>') 
+            uint32_t open_before = num_open_blocks;
+            uint32_t ncode_before = prog->ncode;
+            if (compile_step(prog, &p, end) < 0)
             {
-                fd = args[i][0] - '0';  // Use the digit before '>>' as file descriptor
-                filename = strtok(args[i] + 3, " ");  // Get the filename after '>>'
-            } 
-            else 
-            {
-                filename = strtok(args[i], ">>");  // Get the filename after '>>'
+                status = -1;
+                break;
             }
 
-            // Open the file for appending
-            output = fopen(filename, "a");
-            if (output != NULL) 
-            {
-                dup2(fileno(output), fd);  // Duplicate the file descriptor to redirect output
-                fclose(output);
-                args[i] = NULL;
-            } 
-            else 
-            {
-                perror("fopen");
-                return_var = -1;
-            }
-        }
-        // Redirect output and error 
-        else if (strstr(args[i], "&>") != NULL)
-        {
-            output = fopen(strtok(args[i], "&>"), "w");
-            dup2(fileno(output), STDOUT_FILENO);
-            dup2(fileno(output), STDERR_FILENO);
-            fclose(output);
-            args[i] = NULL; 
-        }
-        else if (strstr(args[i], ">") != NULL) 
-        {
-            int fd = STDOUT_FILENO;  // Default to stdout
-            char *filename;
-    
-            // Check if there's a digit before '>'
-            if (args[i][0] >= '0' && args[i][0] <= '9' && args[i][1] == '>') 
+            // A statement that is the whole line shares the line's text, which was stored first
+            Instr *last = (prog->ncode > ncode_before) ? &prog->code[prog->ncode - 1] : NULL;
+            if (last != NULL && last->op == OP_RUN_LINE && strcmp(prog->pool + last->c, prog->pool + text) == 0
+                && prog->pool_len == last->c + strlen(prog->pool + last->c) + 1)
             {
-                fd = args[i][0] - '0';  // Use the digit before '>' as file descriptor
-                filename = strtok(args[i] + 2, " ");  // Get the filename after '>'
-            } 
-            else 
-            {
-                filename = strtok(args[i], ">");  // Get the filename after '>'
+                prog->pool_len = last->c;
+                last->c = text;
             }
 
-            // Open the file for writing
-            output = fopen(filename, "w");
-            if (output != NULL) 
-            {
-                dup2(fileno(output), fd);  // Duplicate the file descriptor to redirect output
-                fclose(output);
-                args[i] = NULL;
-            } 
-    
-            else 
+            if (open_before == 0 && num_open_blocks > 0) opened = 1;
+            int closed = (open_before > 0 && num_open_blocks == 0);
+            if (closed && opened) ir_emit(prog, OP_HISTORY, text, 0, 0);
+            if (closed) opened = 0;
+            if (line_instr != UINT32_MAX && (closed || (open_before == 0 && prog->ncode > ncode_before)))
             {
-                perror("fopen");
-                return_var = -1;
+                prog->code[line_instr].b = 1;
             }
         }
-        i++;
     }
+    if (num_open_blocks > 0) status = -1;
 
-    // BUILT-IN PROCESSING //
-    if (strcmp(args[0], "exit") == 0)
+    num_open_blocks = 0;
+    syntax_errors_quiet = 0;
+    return status;
+}
+
+/*
+ * Builds the cache file path for a script: $XDG_CACHE_HOME/wsh or ~/.cache/wsh, named by a hash of the
+ * script's path. Creates the directories as needed.
+ * Returns 0, or -1 if there is nowhere to keep caches.
+ */
+int cache_path(const char *script_path, char *path, size_t size)
+{
+    char dir[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg != NULL && xdg[0] == '/') snprintf(dir, sizeof(dir), "%s", xdg);
+    else if (home != NULL && home[0] == '/') snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else return -1;
+
+    mkdir(dir, 0700);
+    size_t len = strlen(dir);
+    if (len + sizeof("/wsh") > sizeof(dir)) return -1;
+    strcpy(dir + len, "/wsh");
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) return -1;
+
+    uint64_t hash = cache_checksum(CACHE_HASH_SEED, script_path, strlen(script_path));
+    if ((size_t)snprintf(path, size, "%s/%016llx.wshc", dir, (unsigned long long)hash) >= size) return -1;
+    return 0;
+}
+
+/*
+ * 64-bit FNV-1a taken a word at a time, continuing from hash. Enough to notice a damaged cache file cheaply.
+ */
+uint64_t cache_checksum(uint64_t hash, const char *data, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
     {
-        wsh_exit(args);
-        cmd_executed = 1;
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
     }
-    else if (strcmp(args[0], "cd") == 0)
+    for (; i < len; i++) hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+/*
+ * Checks that every index and offset in a loaded program stays inside it, so a bad cache cannot
+ * make the shell read out of bounds. Returns 0 if the program is sound.
+ */
+int program_validate(const Program *prog)
+{
+    if (prog->pool_len == 0 || prog->pool[prog->pool_len - 1] != '\0') return -1;
+
+    for (uint32_t i = 0; i < prog->nsegs; i++)
     {
-        wsh_cd(args);
-        cmd_executed = 1;
-    } 
-    else if (strcmp(args[0], "export") == 0)
+        const Segment *seg = &prog->segs[i];
+        if (seg->type > SEG_ARITH || (uint64_t)seg->offset + seg->len >= prog->pool_len) return -1;
+        if (prog->pool[seg->offset + seg->len] != '\0') return -1;
+    }
+    for (uint32_t i = 0; i < prog->ntokens; i++)
     {
-        wsh_export(args);
-        cmd_executed = 1;
+        const IrToken *tok = &prog->tokens[i];
+        if (tok->type > TOK_AMP || tok->text >= prog->pool_len) return -1;
+        if ((uint64_t)tok->first_seg + tok->nsegs > prog->nsegs) return -1;
+    }
+    for (uint32_t i = 0; i < prog->ncode; i++)
+    {
+        const Instr *instr = &prog->code[i];
+        switch (instr->op)
+        {
+            case OP_RUN:
+            case OP_RUN_LINE:
+                if ((uint64_t)instr->a + instr->b > prog->ntokens || instr->c >= prog->pool_len) return -1;
+                break;
+            case OP_FOR_INIT:
+                if ((uint64_t)instr->a + instr->b > prog->ntokens) return -1;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                if (instr->a > prog->ncode) return -1;
+                break;
+            case OP_FOR_NEXT:
+                if (instr->a >= prog->pool_len || instr->b > prog->ncode) return -1;
+                break;
+            case OP_LINE:
+            case OP_HISTORY:
+                if (instr->a >= prog->pool_len) return -1;
+                break;
+            default:
+                return -1;
+        }
     }
-    else if (strcmp(args[0], "local") == 0)
+    return 0;
+}
+
+/*
+ * Maps a script's cache file and points prog into it. The cache must match the script's path, inode,
+ * mtime and size, and pass its checksum and a bounds check. The mapping is read-only, the variable
+ * slots the program caches while running get a zeroed array of their own.
+ * Returns 0, or -1 if there is no usable cache.
+ */
+int cache_load(const char *path, const char *script_path, const struct stat *script_st, Program *prog)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CacheHeader))
     {
-         wsh_local(args);
-         cmd_executed = 1;
+        close(fd);
+        return -1;
     }
-    else if (strcmp(args[0], "vars") == 0)
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    CacheHeader *header = (CacheHeader *)map;
+    size_t path_len = strlen(script_path);
+    size_t offset = sizeof(CacheHeader) + ((path_len + 1 + 7) & ~(size_t)7);
+    size_t code_size = ((size_t)header->ncode * sizeof(Instr) + 7) & ~(size_t)7;
+    size_t tokens_size = ((size_t)header->ntokens * sizeof(IrToken) + 7) & ~(size_t)7;
+    size_t segs_size = ((size_t)header->nsegs * sizeof(Segment) + 7) & ~(size_t)7;
+
+    int valid = memcmp(header->magic, SCRIPT_CACHE_MAGIC, sizeof(header->magic)) == 0
+        && header->dev == (uint64_t)script_st->st_dev && header->ino == (uint64_t)script_st->st_ino
+        && header->mtime_sec == (int64_t)script_st->st_mtim.tv_sec
+        && header->mtime_nsec == (int64_t)script_st->st_mtim.tv_nsec
+        && header->size == (int64_t)script_st->st_size
+        && header->path_len == path_len
+        && offset + code_size + tokens_size + segs_size + header->pool_len == size
+        && memcmp(map + sizeof(CacheHeader), script_path, path_len + 1) == 0
+        && cache_checksum(CACHE_HASH_SEED, map + sizeof(CacheHeader), size - sizeof(CacheHeader)) == header->checksum;
+    if (!valid)
     {
-        wsh_vars();
-        cmd_executed = 1;
+        munmap(map, size);
+        return -1;
     }
-    else if (strcmp(args[0], "history") == 0)
+
+    memset(prog, 0, sizeof(*prog));
+    prog->code = (Instr *)(map + offset);
+    prog->ncode = prog->code_cap = header->ncode;
+    offset += code_size;
+    prog->tokens = (IrToken *)(map + offset);
+    prog->ntokens = prog->tokens_cap = header->ntokens;
+    offset += tokens_size;
+    prog->segs = (Segment *)(map + offset);
+    prog->nsegs = prog->segs_cap = header->nsegs;
+    offset += segs_size;
+    prog->pool = map + offset;
+    prog->pool_len = prog->pool_cap = header->pool_len;
+
+    if (program_validate(prog) < 0)
     {
-        wsh_history(args);
-        cmd_executed = 1;
-    } 
-    else if (strcmp(args[0], "ls") == 0)
+        munmap(map, size);
+        return -1;
+    }
+    prog->slots = calloc(prog->nsegs + 1, sizeof(int32_t));
+    if (prog->slots == NULL)
     {
-        wsh_ls(args);
-        cmd_executed = 1;
+        perror("calloc");
+        exit(-1);
     }
+    script_cache_map = map;
+    script_cache_size = size;
+    return 0;
+}
 
-    // Relative / Full path check
-    else if (access(args[0], X_OK) == 0)
+/*
+ * Writes prog as the script's cache file, through a temporary file renamed into place so readers never
+ * see half of one. Caching is best effort, failures are silent.
+ */
+void cache_write(const char *path, const char *script_path, const struct stat *script_st, Program *prog)
+{
+    // A script changed in the last two seconds could change again without its mtime moving
+    if (time(NULL) - script_st->st_mtim.tv_sec < 2) return;
+
+    static const char padding[8] = { 0 };
+    size_t path_len = strlen(script_path);
+    const void *parts[] = { script_path, prog->code, prog->tokens, prog->segs, prog->pool };
+    size_t sizes[] = { path_len + 1, (size_t)prog->ncode * sizeof(Instr), (size_t)prog->ntokens * sizeof(IrToken),
+                       (size_t)prog->nsegs * sizeof(Segment), prog->pool_len };
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCRIPT_CACHE_MAGIC, sizeof(header.magic));
+    header.dev = script_st->st_dev;
+    header.ino = script_st->st_ino;
+    header.mtime_sec = script_st->st_mtim.tv_sec;
+    header.mtime_nsec = script_st->st_mtim.tv_nsec;
+    header.size = script_st->st_size;
+    header.path_len = path_len;
+    header.ncode = prog->ncode;
+    header.ntokens = prog->ntokens;
+    header.nsegs = prog->nsegs;
+    header.pool_len = prog->pool_len;
+
+    // Every part but the pool is padded to 8 bytes. The checksum covers the padding too, taking each
+    // part's last partial word together with its padding as the loader will.
+    uint64_t hash = CACHE_HASH_SEED;
+    for (int i = 0; i < 5; i++)
     {
-        // Fork the new process
-        pid_t pid = fork();
-            
-        // Check for failed fork
-        if(pid < 0)
+        size_t whole = (i < 4) ? (sizes[i] & ~(size_t)7) : sizes[i];
+        hash = cache_checksum(hash, parts[i], whole);
+        if (whole < sizes[i])
         {
-            perror("fork");
-            return_var = -1;
+            char tail[8] = { 0 };
+            memcpy(tail, (const char *)parts[i] + whole, sizes[i] - whole);
+            hash = cache_checksum(hash, tail, sizeof(tail));
         }
+    }
+    header.checksum = hash;
 
-        // Fork successful, check if executable can be executed
-        if (pid == 0) if (execv(args[0], args) == -1)
-        {
-            perror("execv");
-            return_var = -1;
-        } 
+    char tmp[PATH_MAX];
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp)) return;
+    int fd = mkstemp(tmp);
+    if (fd < 0) return;
+    int ok = write_all(fd, (const char *)&header, sizeof(header)) == 0;
+    for (int i = 0; i < 5 && ok; i++)
+    {
+        size_t pad = (i < 4) ? ((8 - (sizes[i] & 7)) & 7) : 0;
+        ok = write_all(fd, parts[i], sizes[i]) == 0 && write_all(fd, padding, pad) == 0;
+    }
+    if (close(fd) < 0) ok = 0;
+    if (!ok || rename(tmp, path) < 0) unlink(tmp);
+}
 
-        cmd_executed = 1;
-        // Wait for child(executable) to finish
-        int status;
-        if (waitpid(pid, &status, 0) >0)
+/*
+ * Releases the whole-script program, whether it was compiled in memory or points into a cache mapping
+ */
+void script_program_free()
+{
+    if (script_cache_map != NULL)
+    {
+        free(script_program->slots);
+        free(script_program);
+        munmap(script_cache_map, script_cache_size);
+    }
+    else program_free(script_program);
+    script_program = NULL;
+    script_cache_map = NULL;
+}
+
+/*
+ * Runs a batch script from its cache, compiling and caching it first when the cache is missing or
+ * stale. Takes ownership of fd when it returns 1. Returns 0, with fd untouched, when the script should
+ * run uncached: caching is off (WSH_CACHE=0), the script is not a regular file of a cacheable size,
+ * or it does not compile.
+ */
+int run_cached_script(const char *script_path, int fd)
+{
+    const char *setting = getenv("WSH_CACHE");
+    if (setting != NULL && strcmp(setting, "0") == 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < SCRIPT_CACHE_MIN || st.st_size > SCRIPT_CACHE_MAX) return 0;
+
+    char real_path[PATH_MAX];
+    char path[PATH_MAX];
+    if (realpath(script_path, real_path) == NULL || cache_path(real_path, path, sizeof(path)) < 0) return 0;
+
+    Program *prog = calloc(1, sizeof(Program));
+    if (prog == NULL)
+    {
+        perror("calloc");
+        exit(-1);
+    }
+    if (cache_load(path, real_path, &st, prog) < 0)
+    {
+        // Compile from a second descriptor, mapping leaves fd's offset alone for the uncached fallback
+        ScriptReader reader;
+        int copy = dup(fd);
+        if (copy < 0 || script_open(&reader, copy) < 0)
         {
-            if (WIFEXITED(status))
-            { 
-                return_var = WEXITSTATUS(status);
-            }
-            else return_var = -1;
+            if (copy >= 0) close(copy);
+            free(prog);
+            return 0;
         }
-        else
+        int status = compile_script(&reader, prog);
+        script_close(&reader);
+        if (status < 0)
         {
-            perror("waitpid");
-            return_var = -1;
+            program_free(prog);
+            return 0;
         }
+        cache_write(path, real_path, &st, prog);
     }
+    close(fd);
 
-    // PATHS SPECIFIED BY $PATH //
-    else
+    script_program = prog;
+    run_program(prog);
+    script_program_free();
+    return 1;
+}
+
+/*
+ * Runs a script line by line until EOF, the batch-mode engine behind bash_shell and the server.
+ * Takes ownership of fd.
+ */
+void run_script(int fd)
+{
+    ScriptReader reader;
+    if (script_open(&reader, fd) < 0)
+    {
+        close(fd);
+        return_var = -1;
+        return;
+    }
+    script_input = &reader;
+
+    // Lines are run straight out of the mapping or read buffer
+    const char *script_line;
+    size_t len;
+    while ((script_line = script_next_line(&reader, &len)) != NULL)
     {
-        // Get path
-        char *path = getenv("PATH");
-        char *path_copy = strdup(path); // copy to modify
-        char *all_paths = strtok(path_copy, ":");    // find all paths in PATH variable, delimited by :
+#ifdef WSH_BENCH
+        bench_begin();
+#endif
+        // Drop background jobs that have finished
+        notify_jobs();
 
-        while (all_paths != NULL)
+        if (run_line(script_line, len))
         {
-            // attach command to path
-            char full_path[MAXLINE];
-            snprintf(full_path, sizeof(full_path), "%s/%s", all_paths, args[0]);
+#ifdef WSH_BENCH
+            bench_end();
+#endif
+        }
+    }
 
-            // Check if the command exists and is an executable
-            if (access(full_path, X_OK) == 0)
-            {
-                // Fork the new process
-                pid_t pid = fork();
+    end_of_input();
 
-                // Check for failed fork
-                if (pid < 0) 
-                {
-                    perror("fork");
-                    return_var = -1;
-                }
+    // Close the script file
+    script_close(&reader);
+    script_input = NULL;
+}
 
-                // Fork successful, check if executable can be executed
-                if (pid == 0) if (execv(full_path, args) == -1) 
-                {
-                    perror("execv");
-                    return_var = -1;
-                } 
+/*
+ * source FILE: Runs a script inside this shell, through the same engine as batch mode, so it
+ * shares variables, jobs and history with the caller. The status is the last command's.
+ */
+void wsh_source(char **args)
+{
+    if (args[1] == NULL)
+    {
+        fprintf(stderr, "source: usage: source FILE\n");
+        return_var = -1;
+        return;
+    }
+    if (source_depth >= SOURCE_MAX_DEPTH)
+    {
+        fprintf(stderr, "source: %s: nested too deeply\n", args[1]);
+        return_var = -1;
+        return;
+    }
 
-                cmd_executed = 1;
-                // Wait for child(executable) to finish
-                int status;
-                if (waitpid(pid, &status, 0) >0)
-                {
-                    if (WIFEXITED(status))
-                    { 
-                       if(WEXITSTATUS(status) == 0) return_var = 0;
-                    }       
-                    else return_var = -1;
-                }
-                else
-                {
-                    perror("waitpid");
-                    return_var = -1;
-                }
-            }
+    int fd = open(args[1], O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(args[1]);
+        return_var = -1;
+        return;
+    }
 
-            // Otherwise, check next location
-            all_paths = strtok(NULL, ":");
-        }
+    // The script or program running the source command carries on once the file is done
+    ScriptReader *outer_input = script_input;
+    Program *outer_program = script_program;
+    char *outer_map = script_cache_map;
+    size_t outer_size = script_cache_size;
+    script_input = NULL;
+    script_program = NULL;
+    script_cache_map = NULL;
 
-        // free strdup
-        free(path_copy);
-    }
+    return_var = 0;
+    source_depth++;
+    if (!run_cached_script(args[1], fd)) run_script(fd);
+    source_depth--;
 
-    // Store the original command in history, if not executed from history
-    if (args[0] != NULL && from_history == 0 && cmd_executed == 1) 
-    {
-        if (!(strcmp(args[0], "exit") == 0) &&
-            !(strcmp(args[0], "cd") == 0) &&
-            !(strcmp(args[0], "export") == 0) &&
-            !(strcmp(args[0], "local") == 0) &&
-            !(strcmp(args[0], "vars") == 0) &&
-            !(strcmp(args[0], "history") == 0) &&
-            !(strcmp(args[0], "ls") == 0)) {
+    script_input = outer_input;
+    script_program = outer_program;
+    script_cache_map = outer_map;
+    script_cache_size = outer_size;
+}
 
-            // Add the original command line to history
-            if (history_list[0] == NULL || strcmp(history_list[0], original_line) != 0) 
-            {
-                // Shift history list to make room for the new command
-                if (history_list[history_list_size - 1] != NULL) 
-                {
-                    free(history_list[history_list_size - 1]);
-                }
-                for (int j = history_list_size - 1; j > 0; j--) 
-                {
-                    history_list[j] = history_list[j - 1];
-                }
-                // Add new command to history
-                history_list[0] = strdup(original_line);
-            }
-        }
+/*
+ * exec [CMD ARGS...]: Replaces the shell with CMD, without forking. Redirections were already applied
+ * to the shell, so with no command they stay in place for the commands that follow.
+ */
+void wsh_exec(char **args)
+{
+    return_var = 0;
+    if (args[1] == NULL) return;
+
+    const char *full_path = resolve_command(args[1]);
+    if (full_path == NULL)
+    {
+        fprintf(stderr, "exec: %s: command not found\n", args[1]);
+        return_var = -1;
+        return;
     }
 
-    // Restore stdout and stdin
-    dup2(saved_stdin, STDIN_FILENO);
-    dup2(saved_stdout, STDOUT_FILENO);
-    dup2(saved_stderr, STDERR_FILENO);
-    close(saved_stdin);
-    close(saved_stdout);
-    close(saved_stderr);
+    // Nothing the shell buffered may be lost, and the command starts with the signals a spawned child gets
+    fflush(stdout);
+    fflush(stderr);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
 
-    if (cmd_executed == 0)
+    execv(full_path, args + 1);
+
+    perror("execv");
+    if (job_control)
     {
-        perror("Invalid command");
-        return_var = -1;
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
     }
+    return_var = -1;
 }
 
-
-void interactive_shell()
+int bash_shell(int argc, char *argv[]) 
 {
-    // Allocate memory for polling from stdin to line, and tokenizing arguments
-    char *token;
-    char original_line[MAXLINE];
-
-    // Interactive 
-    while (1)
-    {   
-        // If stdout is redirected and terminal is still stdiin, then print out shell prompt
-        if (!isatty(STDOUT_FILENO) && isatty(STDIN_FILENO))
-        {
-            FILE *terminal = fopen("/dev/tty", "w");
-            fprintf(terminal, "wsh> ");
-            fclose(terminal);
-        }
-        
+    // Open the script file
+    int fd = open(argv[argc-1], O_RDONLY | O_CLOEXEC);
 
-        printf("wsh> ");
-        if (fgets(line, MAXLINE, stdin) != NULL)
-        {  
-            // Forces output buffer to be fed immediately (issue earlier)
-            fflush(stdout);
-        }
+    if (fd < 0) 
+    {
+        perror("open");
+        return 0;
+    }
 
-        // Reading from other input (not terminal), check if EOF
-        else if (!isatty(STDIN_FILENO))
-        {
-            if (feof(stdin)) break;
-        }
-        
-        // Check for empty input or comments
-        if (line[0] == '\0' || line[0] == '#') continue;
-       
-        // Otherwise, tokenize input, check for command, and store args, delimited by spaces
-        line[strcspn(line, "\n")] = 0;  // remove null terminating character
+    // Scripts run from their precompiled cache when they can
+    init_jobs();
+    if (!run_cached_script(argv[argc-1], fd)) run_script(fd);
 
-        // Store original line for history
-        strcpy(original_line, line); 
+    // To keep track on if bash ran or not
+    return 1;
+}
 
-        token = strtok(line, " ");
+/*
+ * Receives one message carrying descriptors passed with SCM_RIGHTS, storing up to max_fds of them in fds.
+ * Returns how many arrived, or -1 if the message could not be read.
+ */
+int recv_fds(int sock, int *fds, int max_fds)
+{
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
 
-        // Reset arg index
-        int i = 0;
-    
-        while (token != NULL)
-        {
-            args[i++] = substitute_var(token);
-            token = strtok(NULL, " ");
-        }
+    union
+    {
+        char buf[CMSG_SPACE(WSH_SERVER_NFDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
 
-        args[i] = NULL; // null terminate args after tokenizing
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
 
-        // Check for empty line
-        if (args[0] == NULL) continue;
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) return -1;
 
-        // FREE TOKEN
-        free(token);
+    int nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
 
-        // Ensure that there are commands to execute
-        if (args[0] != NULL) 
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < count; i++)
         {
-            execute_commands(args, original_line, 0);
+            if (nfds < max_fds) fds[nfds++] = received[i];
+            else close(received[i]);
         }
     }
+    return nfds;
 }
 
-int bash_shell(int argc, char *argv[]) 
+/*
+ * Sends the exit status back to a server-mode client, once, and only from the connection's own
+ * process so exits in forked built-ins and substitutions do not report for the whole script
+ */
+void server_report()
 {
-    // Open the script file
-    FILE *input = fopen(argv[argc-1], "r");
+    if (server_conn < 0 || getpid() != server_pid) return;
 
-    if (input == NULL) 
+    fflush(stdout);
+    fflush(stderr);
+    int32_t status = return_var;
+    if (send(server_conn, &status, sizeof(status), MSG_NOSIGNAL) < 0) perror("send");
+    close(server_conn);
+    server_conn = -1;
+}
+
+/*
+ * Runs one client's script, in a process forked from the server for this connection so its
+ * variables, history, jobs and cwd start fresh and die with it.
+ * The client passes the script, its stdin, stdout and stderr and its cwd, in that order,
+ * and gets the script's exit status back on the socket.
+ */
+void serve_connection(int conn)
+{
+    int fds[WSH_SERVER_NFDS];
+    if (recv_fds(conn, fds, WSH_SERVER_NFDS) != WSH_SERVER_NFDS)
     {
-        perror("fopen");
-        return 0;
+        fprintf(stderr, "wsh: server: client did not pass %d descriptors\n", WSH_SERVER_NFDS);
+        _exit(1);
     }
 
-    // Allocate memory for polling input from stdin to line
-    char line[MAXLINE];
-    char original_line[MAXLINE];
+    // The client's stdio replaces the server's, and its cwd becomes ours
+    dup2(fds[1], STDIN_FILENO);
+    dup2(fds[2], STDOUT_FILENO);
+    dup2(fds[3], STDERR_FILENO);
+    if (fchdir(fds[4]) < 0) perror("fchdir");
+    for (int i = 1; i < WSH_SERVER_NFDS; i++) close(fds[i]);
+
+    server_conn = conn;
+    server_pid = getpid();
+
+    init_jobs();
+    run_script(fds[0]);
+
+    server_report();
+    free_memory();
+    _exit(return_var & 0xff);
+}
+
+/*
+ * --server <path>: Listens on a Unix domain socket and runs each connection's script through the
+ * batch-mode engine, so clients skip the shell's startup. Only returns on error.
+ */
+int wsh_server(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "wsh: server: socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
 
-    // Iterate through the file until EOF (fgets returns NULL)
-    while (fgets(line, MAXLINE, input) != NULL) 
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
     {
-        // Remove newline character if present
-        line[strcspn(line, "\n")] = 0;
+        perror("socket");
+        return -1;
+    }
 
-        // Store original line for history
-        strcpy(original_line, line); 
-        
-        // Ignore comments
-        if (line[0] == '#') 
-        {
-            continue;  // Skip comments
-        }
+    // A socket left behind by an earlier server is replaced, anything else is not touched
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
 
-        // Check for empty input
-        if (line[0] == '\0') continue;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, SOMAXCONN) < 0)
+    {
+        perror(path);
+        close(sock);
+        return -1;
+    }
 
-        // Tokenize the input line and store args
-        char *token = strtok(line, " ");
-        int i = 0;
+    // Connection processes are reaped by the kernel, each one installs its own SIGCHLD handler
+    signal(SIGCHLD, SIG_IGN);
 
-        while (token != NULL) 
+    while (1)
+    {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0)
         {
-            args[i++] = substitute_var(token);  // Variable substitution
-            token = strtok(NULL, " ");
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            break;
         }
 
-        args[i] = NULL; // Null-terminate args after tokenizing
-
-        // Check for empty line
-        if (args[0] == NULL) continue;
-        
-        // FREE TOKEN
-        free(token);
-
-        // Ensure that there are commands to execute
-        if (args[0] != NULL) 
-        {   
-            // Close input on exit
-            if (strcmp(args[0], "exit") == 0) fclose(input);
-            execute_commands(args, original_line, 0);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(sock);
+            serve_connection(conn);
         }
+        else if (pid < 0) perror("fork");
+        close(conn);
     }
 
-    // Close the script file
-    fclose(input);
-
-    // To keep track on if bash ran or not
-    return 1;
+    close(sock);
+    return -1;
 }
 
-
 int main(int argc, char *argv[])
 { 
+    check_builtins();
+
     // Initialize the history list
-    history_list = malloc(history_list_size * sizeof(char *));
+    history_list = calloc(history_list_size, sizeof(HistoryEntry));
     if (history_list == NULL) 
     {
-        perror("malloc");
+        perror("calloc");
         exit(-1);
     }
-    for (int i = 0; i < history_list_size; i++) {
-        history_list[i] = NULL;
-    }
 
     // Set initial path
     setenv("PATH", "/bin", 1);  // This sets the PATH to only include /bin
 
+    // Server mode, every connection runs a script in a copy of this freshly started shell
+    if (argc == 3 && strcmp(argv[1], "--server") == 0)
+    {
+        wsh_server(argv[2]);
+        free_memory();
+        return 1;
+    }
+
+    // The zygote is forked before the shell builds up any state
+    char *zygote = getenv("WSH_ZYGOTE");
+    if (zygote != NULL && strcmp(zygote, "1") == 0) zygote_start();
+
     // For file redirections
     FILE *input;
     FILE *output;
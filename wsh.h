@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For pipe2 and other Linux extensions
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,18 +7,512 @@
 #include <dirent.h>  // For directory operations
 #include <errno.h>   // For error handling
 #include <ctype.h> // For isDigit
+#include <fcntl.h>  // For open flags
+#include <spawn.h>  // For posix_spawn
+#include <signal.h> // For SIGCHLD and job control
+#include <poll.h>   // For waiting on stdin and the SIGCHLD pipe
+#include <stdint.h> // For fixed width integers
+#include <time.h>   // For clock_gettime
+#include <sys/resource.h> // For getrusage and wait4
+#include <sys/time.h>     // For timeval arithmetic
+#include <sys/uio.h>      // For writev
+#include <sys/stat.h>     // For the test built-in's file checks
+#include <sys/sendfile.h> // For the cat built-in
+#include <sys/socket.h>   // For server mode
+#include <sys/un.h>       // For server mode's Unix domain socket
+#include <sys/mman.h>     // For mapping batch scripts
+#include <stdarg.h>       // For syntax_error
+#include <sys/file.h>     // For flock on the history file
+#include <termios.h>      // For the line editor
+#include <sys/syscall.h>  // For pidfd_open and pidfd_send_signal
+#include <assert.h>       // For the built-in registry order check
 
-#define MAXLINE 1024
-#define MAXARGS 128
+extern char **environ;
+
+#define CAT_CHUNK_SIZE (1 << 30)    // Most bytes cat asks the kernel to copy at once
+#define SUBST_CHUNK_SIZE 4096        // First read size when capturing $(...) output
+#define ARENA_BLOCK_SIZE (64 * 1024) // Line arena block size, larger lines get larger blocks
+#define WSH_SERVER_NFDS 5            // Descriptors a client passes: script, stdin, stdout, stderr, cwd
+#define ZYGOTE_NFDS 4                // Descriptors passed with each spawn request: stdin, stdout, stderr, cwd
+#define LS_BATCH_SIZE (256 * 1024) // getdents64 batch and output chunk size for ls
+#define SCRIPT_CHUNK_SIZE (1024 * 1024)        // Read size for scripts that cannot be mapped
+#define SCRIPT_RELEASE_SIZE (16 * 1024 * 1024) // Mapped script bytes run before their pages are given back
+#define SCRIPT_CACHE_MIN (16 * 1024)          // Smaller scripts are not worth a cache file
+#define SCRIPT_CACHE_MAX (512 * 1024 * 1024)  // Larger scripts would overflow the program's 32-bit offsets
+#define SCRIPT_CACHE_MAGIC "WSHIR03"          // Changes whenever the cache layout or the IR does
+#define SOURCE_MAX_DEPTH 64                    // Deeper source nesting is taken to be a script sourcing itself
+#define TIMEOUT_KILL_DELAY 1                   // Seconds timeout waits after its signal before sending SIGKILL
+#define TIMEOUT_STATUS 124                     // Status of a command timeout had to stop
+#define HISTORY_FILE_NAME ".wsh_history"          // In $HOME, unless WSH_HISTFILE names another file
+#define HISTORY_INDEX_BITS 18                       // The history search index has 2^18 trigram buckets
+#define HISTORY_INDEX_BUCKETS (1u << HISTORY_INDEX_BITS)
+#define CACHE_HASH_SEED 14695981039346656037ULL // FNV-1a offset basis
+
+// One planned redirection: filename opened with flags onto fd, &> and &>> also cover stderr
+typedef struct Redirect
+{
+    int fd;
+    int both;
+    int flags;
+    char *filename;
+} Redirect;
+
+// Kinds of token produced by the lexer
+typedef enum TokenType
+{
+    TOK_END,
+    TOK_WORD,
+    TOK_REDIR,
+    TOK_PIPE,
+    TOK_AMP
+} TokenType;
+
+// One lexed token: a word with its expansions done, or an operator. Redirections carry their parsed plan.
+typedef struct Token
+{
+    TokenType type;
+    char *text;          // The expanded word, or the operator as written
+    Redirect redir;      // TOK_REDIR only
+    int quoted;          // The word or redirection target had quotes
+    uint32_t first_seg;  // While compiling, the word's segments in the program, or with nsegs 0 its literal text
+    uint32_t nsegs;
+} Token;
+
+// Instructions of a compiled arithmetic expression, run on a stack of 64-bit values
+enum
+{
+    ARITH_NUM,          // Push value
+    ARITH_VAR,          // Push the value of variable name
+    ARITH_ASSIGN,       // Pop a value, store it in name, combined with the old value by op value unless that is ARITH_NUM, and push the result
+    ARITH_INCR,         // Add value to name and push the new value, or the old one if target is set
+    ARITH_NEG,
+    ARITH_NOT,
+    ARITH_BITNOT,
+    ARITH_POW,
+    ARITH_MUL,
+    ARITH_DIV,
+    ARITH_MOD,
+    ARITH_ADD,
+    ARITH_SUB,
+    ARITH_SHL,
+    ARITH_SHR,
+    ARITH_LT,
+    ARITH_LE,
+    ARITH_GT,
+    ARITH_GE,
+    ARITH_EQ,
+    ARITH_NE,
+    ARITH_BITAND,
+    ARITH_BITXOR,
+    ARITH_BITOR,
+    ARITH_AND,          // Pop, and if it is 0 push 0 and jump to target
+    ARITH_OR,           // Pop, and if it is not 0 push 1 and jump to target
+    ARITH_BOOL,         // Turn the top value into 0 or 1
+    ARITH_JUMP_IF_ZERO, // Pop, and jump to target if it is 0
+    ARITH_JUMP,
+    ARITH_POP
+};
+
+typedef struct ArithOp
+{
+    uint32_t op;
+    uint32_t target;  // Jump target, or for ARITH_INCR whether the old value is pushed
+    int64_t value;
+    const char *name; // Variable name, in the line arena
+} ArithOp;
+
+// State of the arithmetic compiler, which emits code for the expression text at pos
+typedef struct ArithCompiler
+{
+    const char *pos;
+    ArithOp *code;
+    uint32_t count;
+    uint32_t cap;
+    int failed;
+} ArithCompiler;
+
+// A word under construction in the line arena
+typedef struct WordBuf
+{
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t lit_start;  // While compiling, where the literal text not yet in a segment starts
+    int in_quotes;     // While compiling, whether the lexer is inside double quotes
+} WordBuf;
+
+// Kinds of word segment in a compiled block
+enum
+{
+    SEG_LIT,    // Literal text
+    SEG_VAR,    // Variable name
+    SEG_CMDSUB, // Text of a $(...)
+    SEG_ARITH   // Expression of a $((...))
+};
+
+// One piece of a compiled word. Text lives in the program's string pool.
+typedef struct Segment
+{
+    uint32_t type;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t hash;    // Variable name hash, computed when compiled
+    uint32_t quoted;  // Expanded inside double quotes, so for loops never split it
+} Segment;
+
+// A compiled token, its word or redirection target is a run of segments. A word that is
+// only literal text has no segments and keeps the text in text instead.
+typedef struct IrToken
+{
+    uint32_t type;
+    uint32_t quoted;
+    uint32_t first_seg;
+    uint32_t nsegs;
+    uint32_t text;  // Operator as written or literal word, offset into the pool
+    int32_t fd;     // Redirection plan, TOK_REDIR only
+    int32_t both;
+    int32_t flags;
+} IrToken;
+
+// Instructions of a compiled block
+enum
+{
+    OP_RUN,            // Expand tokens a..a+b and run them as a command, c is its source text
+    OP_JUMP,           // Continue at a
+    OP_JUMP_IF_FALSE,  // Continue at a if the last command failed
+    OP_FOR_INIT,       // Expand words a..a+b and start a for loop over them
+    OP_FOR_NEXT,       // Set variable a to the loop's next word, or end the loop and continue at b
+    OP_RUN_LINE,       // OP_RUN for a statement outside any block, recorded in history as its script line
+    OP_LINE,           // A script line starts: its text is a, b is set if anything on it runs
+    OP_HISTORY         // Record script line a in history, after a block that opened and closed on it
+};
+
+typedef struct Instr
+{
+    uint32_t op;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+} Instr;
+
+// A compiled if/while/for block, or a whole script for the cache. Everything but the slots is referenced
+// by index or offset, never by pointer, so a program can be written out and mapped back as is.
+typedef struct Program
+{
+    Instr *code;
+    uint32_t ncode;
+    uint32_t code_cap;
+    IrToken *tokens;
+    uint32_t ntokens;
+    uint32_t tokens_cap;
+    Segment *segs;
+    uint32_t nsegs;
+    uint32_t segs_cap;
+    char *pool;
+    uint32_t pool_len;
+    uint32_t pool_cap;
+    int32_t *slots;  // Per segment, one more than where its variable was last found, 0 if not yet. Never cached.
+} Program;
+
+// Kinds and stages of a construct still open while compiling
+enum { BLOCK_IF, BLOCK_WHILE, BLOCK_FOR };
+enum { BLOCK_COND, BLOCK_BODY, BLOCK_ELSE };
+
+typedef struct OpenBlock
+{
+    int kind;
+    int stage;
+    uint32_t start;  // Instruction a loop jumps back to
+    uint32_t patch;  // Jump whose target is not known yet
+    uint32_t var;    // for loop variable name, offset into the pool
+} OpenBlock;
+
+// A running for loop's words
+typedef struct ForLoop
+{
+    char **words;
+    uint32_t count;
+    uint32_t next;
+} ForLoop;
+
+// Header of a script cache file. The script's path follows it, then the program's instructions, tokens,
+// segments and string pool, each starting at a multiple of 8 bytes.
+typedef struct CacheHeader
+{
+    char magic[8];
+    uint64_t dev;       // The script the cache was compiled from
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint32_t path_len;
+    uint32_t ncode;
+    uint32_t ntokens;
+    uint32_t nsegs;
+    uint32_t pool_len;
+    uint32_t reserved;
+    uint64_t checksum;  // Over everything after the header
+} CacheHeader;
+
+// Line numbers of the history file lines that contain a trigram in one index bucket, in increasing order
+typedef struct HistoryPostings
+{
+    uint32_t *ids;
+    uint32_t count;
+    uint32_t cap;
+} HistoryPostings;
+
+// Trigram index over the mapped history file, extended as the file grows
+typedef struct HistoryIndex
+{
+    char *map;
+    size_t map_len;
+    size_t indexed;              // Bytes of the file split into lines and indexed so far
+    uint64_t *lines;             // Where each indexed line starts, oldest first
+    uint32_t nlines;
+    uint32_t lines_cap;
+    HistoryPostings *postings;   // HISTORY_INDEX_BUCKETS lists
+} HistoryIndex;
+
+// A batch script's lines, handed out in place as (pointer, length) slices: from a read-only mapping of
+// a regular file, or from a large read buffer for pipes and terminals. Lines are not NUL terminated.
+typedef struct ScriptReader
+{
+    int fd;
+    char *map;        // The whole file when mapped, otherwise NULL
+    size_t released;  // Leading mapped bytes already given back
+    char *buf;        // Read buffer, when the input is not mapped
+    size_t buf_cap;
+    size_t start;     // First byte not yet handed out
+    size_t end;       // End of the mapped file or of the buffered bytes
+    int eof;
+} ScriptReader;
+
+// Header of a spawn request sent to the zygote, followed by len bytes of payload:
+// 3 int32 per redirection (fd, both, flags), then NUL terminated path, argv, changed environment
+// entries and redirection filenames
+typedef struct ZygoteRequest
+{
+    uint32_t len;
+    uint32_t argc;
+    uint32_t nenv;
+    uint32_t nredirs;
+} ZygoteRequest;
+
+// The zygote's answer once the command has finished
+typedef struct ZygoteReply
+{
+    int32_t spawned;
+    int32_t status;
+    struct rusage usage;
+} ZygoteReply;
+
+// Built-in flags
+#define BUILTIN_HISTORY 0x1 // Recorded in history like an external command
+#define BUILTIN_STDIO 0x2   // Uses stdio, so its redirections are applied with save/restore
+#define BUILTIN_KEEP_REDIRECTS 0x4 // Its redirections are applied to the shell for good, as exec's are
+
+// One entry in the built-in registry
+typedef struct Builtin
+{
+    const char *name;
+    void (*handler)(char **args);
+    int flags;
+} Builtin;
+
+// Resource usage of one command, reported by time and set -o timelog
+typedef struct CommandTimes
+{
+    double real;
+    double user;
+    double sys;
+    long maxrss;
+    long minflt;
+    long majflt;
+    long nvcsw;
+    long nivcsw;
+} CommandTimes;
+
+// Snapshot taken when a measured command starts
+typedef struct Measurement
+{
+    struct timespec start;
+    struct rusage self;
+    struct rusage children;
+} Measurement;
+
+// A descriptor replaced by a built-in's redirection, and the copy it is restored from
+typedef struct SavedFd
+{
+    int fd;
+    int copy;
+} SavedFd;
 
 void wsh_exit(char **args);
 void wsh_cd(char **args);
-void wsh_export();
-void ws_local(char **args);
-void ws_vars();
-void ws_history();
-void ws_ls();
-void ws_history(char **args);
+void wsh_export(char **args);
+void wsh_vars(char **args);
+void wsh_ls(char **args);
+void wsh_history(char **args);
+void wsh_local(char **args);
+void wsh_hash(char **args);
+void wsh_echo(char **args);
+void wsh_true(char **args);
+void wsh_false(char **args);
+int test_integer(const char *arg, long *value);
+int test_eval(char **argv, int argc);
+void wsh_test(char **args);
+int cat_fd(int in_fd);
+void wsh_cat(char **args);
+int printf_escapes(const char *str, int stop);
+void wsh_printf(char **args);
+unsigned int hash_string(const char *s);
+void hash_clear();
+char *find_in_path(const char *cmd);
+const char *lookup_command(const char *cmd);
 void interactive_shell();
 int bash_shell(int argc, char *argv[]);
-void execute_commands(char **args, char *original_line, int from_history);
\ No newline at end of file
+void execute_commands(Token *tokens, const char *original_line, size_t line_len, int from_history);
+void run_command(Token *tokens, const char *original_line, size_t line_len, int from_history);
+void check_builtins();
+const Builtin *find_builtin(const char *name);
+void touch_redirects(const Redirect *redirs, int nredirs);
+int apply_redirects(const Redirect *redirs, int nredirs);
+pid_t wsh_spawn(const char *path, char **argv, int in_fd, int out_fd, const Redirect *redirs, int nredirs, pid_t pgid);
+pid_t wsh_spawn_env(const char *path, char **argv, char **envp, int in_fd, int out_fd, const Redirect *redirs, int nredirs, pid_t pgid);
+const char *resolve_command(const char *cmd);
+int execute_pipeline(Token *tokens, int background, const char *command, size_t command_len);
+void word_reserve(WordBuf *word, size_t len);
+void word_append(WordBuf *word, const char *str, size_t len);
+const char *find_subst_end(const char *s, const char *end);
+void command_substitution(const char *cmd, WordBuf *word);
+const char *find_arith_end(const char *s, const char *end);
+void arith_skip_blanks(ArithCompiler *c);
+uint32_t arith_emit(ArithCompiler *c, uint32_t op, int64_t value, const char *name);
+const char *arith_name(ArithCompiler *c);
+int arith_assign_op(const char *s, int *len);
+int arith_binary_op(const char *s, int *len, int *prec);
+void arith_expr(ArithCompiler *c);
+void arith_assign(ArithCompiler *c);
+void arith_ternary(ArithCompiler *c);
+void arith_binary(ArithCompiler *c, int min_prec);
+void arith_unary(ArithCompiler *c);
+void arith_primary(ArithCompiler *c);
+ArithOp *arith_compile(const char *expr, uint32_t *count);
+int arith_value(const char *name, int64_t *value);
+int arith_store(const char *name, int64_t value);
+int64_t arith_apply(uint32_t op, int64_t a, int64_t b);
+int arith_run(const ArithOp *code, uint32_t count, int64_t *result);
+int arith_eval(const char *expr, int64_t *result);
+void wsh_let(char **args);
+int expand_var(const char **p, const char *end, WordBuf *word);
+size_t span_until(const char *s, const char *end, const unsigned char *stop);
+char *lex_word(const char **p, const char *end, int *quoted);
+Token *lex_command(const char **pos, const char *end);
+void syntax_error(const char *format, ...);
+void word_flush_literal(WordBuf *word);
+void compile_literal_word(Token *tok);
+void *grow_array(void *array, uint32_t count, uint32_t *capacity, size_t elem_size);
+uint32_t ir_add_string(Program *prog, const char *str, size_t len);
+void ir_add_segment(Program *prog, uint32_t type, const char *text, size_t len, int quoted);
+uint32_t ir_emit(Program *prog, uint32_t op, uint32_t a, uint32_t b, uint32_t c);
+uint32_t ir_add_tokens(Program *prog, const Token *tokens, int count);
+void ir_emit_run(Program *prog, uint32_t op, const Token *tokens, int count, const char *source, size_t source_len);
+void program_free(Program *prog);
+char *get_local_cached(const char *name, unsigned int hash, int32_t *pos);
+int ir_expand_segment(Program *prog, uint32_t index, WordBuf *word);
+char *ir_expand_word(Program *prog, uint32_t first, uint32_t nsegs);
+char **ir_expand_fields(Program *prog, uint32_t first, uint32_t count, uint32_t *nfields);
+Token *ir_expand(Program *prog, uint32_t first, uint32_t count);
+void run_program(Program *prog);
+size_t starts_keyword(const char *text, const char *end, const char *keyword);
+int starts_block(const char *text, const char *end);
+int is_keyword(const Token *tok, const char *keyword);
+void compile_abort();
+int compile_step(Program *prog, const char **p, const char *end);
+int compile_statement(const char **p, const char *end);
+int execute_text(const char *text, const char *end, int from_history);
+Token *words_to_tokens(char **words);
+Token *build_command(Token *tokens, char ***argv, Redirect **redirs, int *nredirs);
+void add_history(const char *original_line, size_t len);
+int history_push(const char *entry, size_t len);
+void wsh_set(char **args);
+void init_jobs();
+void sigchld_handler(int sig);
+void wait_for_input();
+char *join_tokens(const Token *tokens);
+int wait_foreground(pid_t *pids, int npids, const char *command, size_t len);
+void reap_jobs();
+void notify_jobs();
+void wsh_jobs(char **args);
+void wsh_wait(char **args);
+void wsh_fg(char **args);
+void wsh_bg(char **args);
+int rebuild_var_index(int new_size);
+int find_var_slot(const char *name, unsigned int hash);
+char *get_local(const char *name);
+int set_local(const char *name, const char *value);
+void unset_local(const char *name);
+char *history_get(int n);
+int history_resize(int new_size);
+void history_open();
+int history_map_refresh();
+uint32_t trigram_bucket(const char *s);
+void history_index_reset();
+void history_index_update();
+const char *history_line(uint32_t id, size_t *len);
+int history_search_next(const char *query, uint32_t *cursor, const char **match, size_t *len);
+void history_append(const char *entry, size_t len);
+void history_close();
+void line_reserve(size_t len);
+void editor_redraw(const char *prompt, const char *query, const char *text, size_t len);
+ssize_t read_line_edited(const char *prompt);
+int write_all(int fd, const char *buf, size_t len);
+int save_fds(const Redirect *redirs, int nredirs, SavedFd *saved);
+void restore_fds(SavedFd *saved, int nsaved);
+#ifdef WSH_BENCH
+void bench_begin();
+void bench_end();
+void bench_flush();
+#endif
+void add_rusage(struct rusage *total, const struct rusage *usage);
+void measure_begin(Measurement *m);
+void measure_end(Measurement *m, CommandTimes *times);
+void wsh_time(char **args);
+void write_timelog(const CommandTimes *times, const char *command);
+int signal_number(const char *name);
+int parse_duration(const char *text, struct timespec *duration);
+int wait_child(pid_t pid, int pidfd, const struct timespec *timeout);
+void signal_child(pid_t pid, int pidfd, int sig);
+void wsh_timeout(char **args);
+pid_t spawn_builtin(const Builtin *builtin, char **argv, int in_fd, int out_fd, const Redirect *redirs, int nredirs, pid_t pgid);
+char **parallel_argv(char **template, int template_len, const char *input);
+char **read_input_lines(int fd, char **buffer_out);
+void wsh_parallel(char **args);
+int run_line(const char *line, size_t len);
+int script_open(ScriptReader *reader, int fd);
+const char *script_next_line(ScriptReader *reader, size_t *len);
+void script_close(ScriptReader *reader);
+void run_script(int fd);
+void wsh_source(char **args);
+void wsh_exec(char **args);
+int compile_script(ScriptReader *reader, Program *prog);
+int cache_path(const char *script_path, char *path, size_t size);
+uint64_t cache_checksum(uint64_t hash, const char *data, size_t len);
+int program_validate(const Program *prog);
+int cache_load(const char *path, const char *script_path, const struct stat *script_st, Program *prog);
+void cache_write(const char *path, const char *script_path, const struct stat *script_st, Program *prog);
+void script_program_free();
+int run_cached_script(const char *script_path, int fd);
+int recv_fds(int sock, int *fds, int max_fds);
+void server_report();
+void serve_connection(int conn);
+int wsh_server(const char *path);
+int env_compare(const void *a, const void *b);
+void zygote_start();
+int read_all(int fd, void *buf, size_t len);
+void zygote_main(int sock);
+int zygote_run(const char *path, char **argv, const Redirect *redirs, int nredirs, int *status);
+void zygote_stop();
+void zygote_detach();
+void end_of_input();